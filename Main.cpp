@@ -2,6 +2,7 @@
 #include "Evaluation.h"
 #include "Interface.h"
 #include "NNUE.h"
+#include "NNUEKernels.h"
 #include "Uci.h"
 #include "Utils.h"
 #include "ZobristKeys.h"
@@ -16,7 +17,8 @@ int main(int argc, char** argv) {
     Attacks::Init();
     Evaluation::Init(); //after Attacks
     ZobristKeys::Init();
-    nnue.Load();
+    NNUEKernels::Init();
+    NNUENetwork::Load();
 
     int opt;
     while( (opt = getopt(argc, argv, "ij:n:")) != -1 ) {
@@ -32,7 +34,7 @@ int main(int argc, char** argv) {
                 return 0;
             }
             case 'n': { //Path to .nnue file
-                nnue.Load(optarg);
+                NNUENetwork::Load(optarg);
             }
             default: break;
         }
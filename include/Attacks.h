@@ -3,7 +3,33 @@
 
 #include "Constants.h"
 
+//USE_PEXT (CMake option, off by default): index the sliding attacks with PEXT instead of magic multiplication.
+//PEXT is microcoded on AMD before Zen 3, where it is much slower than the magics
+#if defined(USE_PEXT)
+    #if !defined(__BMI2__)
+        #error "USE_PEXT requires BMI2 (-mbmi2)"
+    #endif
+    #include <immintrin.h>
+#endif
+
 namespace Attacks {
+    //Fancy magic bitboards: the relevant blockers of a square are mapped to an index
+    //in a table of precalculated attacks
+    struct Magic {
+        Bitboard mask; //relevant blockers (the edges of the board are excluded)
+        u64 magic;
+        Bitboard* attacks;
+        int shift;
+
+        inline u32 Index(Bitboard blockers) const {
+        #ifdef USE_PEXT
+            return (u32)_pext_u64(blockers, mask);
+        #else
+            return (u32)(((blockers & mask) * magic) >> shift);
+        #endif
+        }
+    };
+
     void Init();
 
     Bitboard GetRay(DIRECTIONS direction, int square);
@@ -12,6 +38,7 @@ namespace Attacks {
     Bitboard AttacksKnights(int square);
     Bitboard AttacksKing(int square);
     Bitboard AttacksSliding(PIECE_TYPE pieceType, int square, Bitboard blockers);
+    Bitboard AttacksSlidingClassical(PIECE_TYPE pieceType, int square, Bitboard blockers); //ray by ray (slow)
 
     //Return the squares between two given squares. Strict straight/diagonal match is required (otherwise returns zero)
     Bitboard Between(int sq1, int sq2);
@@ -23,6 +50,8 @@ namespace Attacks {
     extern Bitboard m_Rays[8][64]; //[DIRECTION][SQUARE]
     extern Bitboard m_NonSlidingAttacks[2][8][64]; //[COLOR][PIECE][SQUARE]
     extern Bitboard m_Between[64][64]; //[SQUARE][SQUARE]
+    extern Magic m_BishopMagics[64]; //[SQUARE]
+    extern Magic m_RookMagics[64]; //[SQUARE]
 }
 
 #endif //ATTACKS_H
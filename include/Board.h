@@ -6,6 +6,7 @@
 
 #include "Fen.h"
 #include "MoveMaker.h"
+#include "NNUE.h"
 
 struct BoardHistory {
     u64 zkey;
@@ -53,6 +54,10 @@ public:
     void MakeNull() { MoveMaker::MakeNull(*this); }
     void TakeNull() { MoveMaker::TakeNull(*this); }
 
+    // NNUE
+    void ResetNNUE(); //full update of the accumulators from the current position
+    NNUE& GetNNUE() const { return m_nnue; }
+
     // Static Exchange Evaluation
     int SEE(Move move);
 
@@ -122,6 +127,9 @@ private:
     unsigned int m_initialPly;
     BoardHistory m_history[MAX_PLY];
 
+    //NNUE accumulators, computed when the position is evaluated (also of a const board)
+    mutable NNUE m_nnue;
+
     friend class Fen;
     friend class MoveMaker;
     friend class MoveGenerator;
@@ -4,9 +4,29 @@
 #include "Constants.h"
 #include "Move.h"
 
+#include <atomic>
+#include <optional>
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#endif
+
 const int MAX_DEPTH = 128;
 const uint DEFAULT_HASH_SIZE = 16; //In MegaBytes
+const u64 MAX_HASH_SIZE = 65536; //In MegaBytes
+const u64 CLEAR_MIN_BYTES_PER_THREAD = 64 * 1024 * 1024; //smaller tables are cleared by one thread
+const int TT_BUCKET_ENTRIES = 6; //entries sharing a cache line
+const int TT_NO_EVAL = INFINITE_I16; //static eval not available (e.g. in check)
 const int PAWN_HASH_SIZE = 8192; //In number of entries
+const int EVAL_CACHE_SIZE = 16384; //In number of entries
+
+//Hint the CPU to bring the cache line of an address, ahead of its use
+inline void PrefetchAddress(const void* address) {
+#ifdef _MSC_VER
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+    __builtin_prefetch(address);
+#endif
+}
 
 // =========================
 // == Transposition table ==
@@ -16,36 +36,57 @@ const int PAWN_HASH_SIZE = 8192; //In number of entries
 //Beta node: the true eval is at least equal to the score (true >= score) LOWER_BOUND
 enum TTENTRY_TYPE { NONE, EXACT, LOWER_BOUND, UPPER_BOUND };
 
-//64(zkey) + 32(move) + 16(score) + 8(depth) + 2(type) + 6(age) = 128
+//16(key) + 16(move) + 16(score) + 16(eval) + 8(depth) + 2(type) + 6(age) = 80
 struct TTEntry {
-    u64 zkey;
+    u16 key; //lowest 16 bits of the zkey
+    u16 bestMove; //Move::Compact()
     i16 score;
+    i16 eval;
     u8 depth;
     u8 type: 2, age: 6;
-    Move bestMove;
 
     void Clear();
+
+    //Everything but the key, packed in a 64-bit word
+    u64 Data() const;
+    void SetData(u64 data);
 };
 
+//A position can be stored in any entry of its bucket (one 64-byte cache line).
+//Lock-free: the stored key is XOR-ed with a 16-bit fold of the data, so a torn
+//write (key and data from different entries) fails the key check
+struct alignas(64) TTBucket {
+    std::atomic<u64> data[TT_BUCKET_ENTRIES];
+    std::atomic<u16> keys[TT_BUCKET_ENTRIES];
+};
+static_assert(sizeof(TTBucket) == 64);
+
 class TT {
 public:
     TT();
     ~TT();
     void Clear();
-    void AddEntry(u64 zkey, int score, TTENTRY_TYPE type, Move bestMove, int depth, int ply, int age);
-    TTEntry* ProbeEntry(u64 zkey, int depth);
+    void AddEntry(u64 zkey, int score, int eval, TTENTRY_TYPE type, Move bestMove, int depth, int ply, int age);
+    std::optional<TTEntry> ProbeEntry(u64 zkey, int depth);
     int OccupancyPerMil();
     u64 NumEntries();
-    void SetSize(int size);
+    void SetSize(u64 size);
     u64 Size() { return m_size; };
+    inline void Prefetch(u64 zkey) { PrefetchAddress(&GetBucket(zkey)); }
 
     int ScoreFromHash(int score, int ply);
 
 private:
     int ScoreToHash(int score, int ply);
-
-    TTEntry* m_entries;
-    u64 m_size;
+    //Multiply-shift: the high 64 bits of zkey * numBuckets are uniform in [0, numBuckets)
+    inline TTBucket& GetBucket(u64 zkey) {
+        __extension__ typedef unsigned __int128 u128;
+        return m_buckets[ ((u128)zkey * m_numBuckets) >> 64 ];
+    }
+
+    TTBucket* m_buckets;
+    u64 m_numBuckets;
+    u64 m_size; //number of entries
 };
 
 // =====================
@@ -68,13 +109,50 @@ public:
     void AddEntry(u64 zkey, int evalMg, int evalEg);
     float Occupancy();
     PawnEntry* ProbeEntry(u64 zkey);
+    inline void Prefetch(u64 zkey) { PrefetchAddress(&m_pawnEntries[zkey % PAWN_HASH_SIZE]); }
 private:
     PawnEntry* m_pawnEntries;
 };
 
+// ================
+// == Eval cache ==
+// ================
+
+struct EvalEntry {
+    u64 zkey;
+    int eval;
+
+    void Clear();
+};
+
+//Direct-mapped cache of the static evals (the final score of Evaluation::Evaluate),
+//so the positions that come back in re-searches and transpositions skip the network
+class EvalCache {
+public:
+    EvalCache();
+    ~EvalCache();
+    void Clear();
+    void AddEntry(u64 zkey, int eval);
+    std::optional<int> ProbeEntry(u64 zkey);
+
+    //Hit-rate counters, kept by Clear
+    void ClearStats() { m_probes = 0; m_hits = 0; }
+    u64 Probes() const { return m_probes; }
+    u64 Hits() const { return m_hits; }
+    float HitRate() const { return m_probes ? (float)m_hits / m_probes : 0; }
+private:
+    EvalEntry* m_evalEntries;
+    u64 m_probes;
+    u64 m_hits;
+};
+
+//The transposition table is shared by all the threads. The pawn hash and the eval cache belong to
+//each Search (kept from one search to the next), bound to the thread that runs it by IterativeDeepening:
+//nullptr outside of a search, and nothing is cached
 namespace Hash {
     extern TT tt;
-    extern PawnHash pawnHash;
+    extern thread_local PawnHash* pawnHash;
+    extern thread_local EvalCache* evalCache;
 }
 
 #endif //HASH_H
@@ -14,6 +14,11 @@ namespace Sorting {
     void SortQuiescence(Board &board, MoveList &moveList);
     void SortEvasions(Board &board, MoveList &moveList);
     void SortMoves(Board &board, MoveList& moveList, TT& tt, const Heuristics &heuristics, int ply);
+    void SortMoves(Board &board, MoveList& moveList, u16 hashMove, const Heuristics &heuristics, int ply);
+
+    //Move ordering scores (0-255), shared with the MovePicker
+    u8 CaptureScore(Board &board, Move move); //captures and promotions
+    u8 QuietScore(Move move, COLOR color, const Heuristics &heuristics); //history: 1-180
 }
 
 class KillerHeuristics {
@@ -3,7 +3,6 @@
 
 #include "Constants.h"
 #include "BitboardUtils.h"
-#include <vector>
 
 enum MOVE_TYPE { NULLMOVE, NORMAL, CAPTURE, CASTLING, PROMOTION, DOUBLE_PUSH, PROMOTION_CAPTURE, ENPASSANT }; //CAPTURE + PROMOTION = PROMOTION_CAPTURE
 enum PROMOTION_TYPE { PROMOTION_QUEEN, PROMOTION_KNIGHT, PROMOTION_ROOK, PROMOTION_BISHOP };
@@ -29,6 +28,9 @@ public:
 
     MoveData Data() const;
 
+    //Compact 16-bit form (from, to, promotion type). Identifies a move within a given position
+    inline u16 Compact() const { return (u16) RetrieveBits(m_move, 12, 0) | PushBits(PromotionType(), 2, 12); };
+
     inline bool IsQuiet() const {
         return !IsCapture() && !IsPromotion();
     }
@@ -88,6 +90,31 @@ struct MoveData {
     PIECE_TYPE capturedType;
 };
 
-typedef std::vector<Move> MoveList;
+const int MAX_MOVES = 256; //legal moves in a position (the maximum known is 218)
+
+//Fixed-capacity list of moves, stored in place: no heap allocations in the search
+class MoveList {
+public:
+    MoveList() : m_size(0) {} //the moves are left uninitialized
+
+    inline void push_back(Move move) { assert(m_size < MAX_MOVES); m_moves[m_size++] = move; }
+    inline void clear() { m_size = 0; }
+
+    inline size_t size() const { return m_size; }
+    inline bool empty() const { return m_size == 0; }
+
+    inline Move* begin() { return m_moves; }
+    inline Move* end() { return m_moves + m_size; }
+    inline const Move* begin() const { return m_moves; }
+    inline const Move* end() const { return m_moves + m_size; }
+
+    inline Move& operator[](size_t index) { assert(index < m_size); return m_moves[index]; }
+    inline const Move& operator[](size_t index) const { assert(index < m_size); return m_moves[index]; }
+    inline Move& front() { return (*this)[0]; }
+
+private:
+    union { Move m_moves[MAX_MOVES]; };
+    size_t m_size;
+};
 
 #endif //MOVE_H
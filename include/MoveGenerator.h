@@ -6,14 +6,23 @@
 
 class Board;
 
+//Captures: captures, en passant and queen promotions. Quiets: the rest (incl. underpromotions)
+enum GEN_TYPE { GEN_ALL, GEN_CAPTURES, GEN_QUIETS };
+
 class MoveGenerator {
 public:
-    MoveList GenerateMoves(Board &board);
-    MoveList GenerateCaptures(Board &board);
+    //The list is reused by the next call
+    MoveList& GenerateMoves(Board &board);
+    MoveList& GenerateCaptures(Board &board);
     Move RandomMove();
 
+    //Staged generation (MovePicker): legal moves of one type, only for the pieces in fromMask.
+    //Pins and king danger are calculated once, so the position must be the same in every call
+    MoveList& GenerateStaged(Board &board, GEN_TYPE genType, Bitboard fromMask = ALL);
+
 private:
     void Init(const Board &board);
+    void Generate(Board &board, GEN_TYPE genType, Bitboard fromMask);
 
     void GeneratePseudoMoves(Board &board);
     void GenerateEvasionMoves(Board &board);
@@ -36,6 +45,9 @@ private:
     COLOR m_color;
     COLOR m_enemyColor;
     bool m_generateQuiet;
+    bool m_generateCaptures;
+    bool m_initialized = false;
+    Bitboard m_fromMask;
 
     Bitboard m_ownPieces;
     Bitboard m_enemyPieces;
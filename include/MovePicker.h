@@ -0,0 +1,54 @@
+#ifndef MOVEPICKER_H
+#define MOVEPICKER_H
+
+#include "Move.h"
+#include "MoveGenerator.h"
+
+class Board;
+struct Heuristics;
+
+enum PICKER_STAGE {
+    STAGE_HASH,
+    STAGE_GEN_CAPTURES, STAGE_GOOD_CAPTURES,
+    STAGE_KILLERS,
+    STAGE_GEN_QUIETS, STAGE_QUIETS,
+    STAGE_BAD_CAPTURES,
+    STAGE_EVASIONS,
+    STAGE_DONE
+};
+
+//Returns the moves of a NegaMax node one by one, in stages:
+//hash move, good captures (SEE >= 0), killers, quiets by history, bad captures.
+//Each stage is generated and scored only when the previous one is exhausted.
+//In check, all the evasions are generated and sorted at once.
+//The scores are the same as in Sorting::SortMoves
+class MovePicker {
+public:
+    MovePicker(Board &board, u16 hashMove, const Heuristics &heuristics, int ply);
+
+    Move NextMove(); //Null move when there are no more moves
+    int NumEvasions() const { assert(m_stage == STAGE_EVASIONS || m_stage == STAGE_DONE); return m_moves->size(); } //in check
+    bool InGoodCaptures() const { return m_stage == STAGE_GOOD_CAPTURES; } //picked by MVV-LVA: not sorted by score
+
+private:
+    Move PickBestCapture();
+    bool IsKiller(Move move) const;
+
+    Board &m_board;
+    MoveGenerator m_gen;
+    const Heuristics &m_heuristics;
+    int m_ply;
+    PICKER_STAGE m_stage;
+
+    u16 m_hashMove;
+    Move m_killers[4];
+    int m_numKillers;
+    int m_killerIndex;
+
+    MoveList* m_moves; //the list of the generator
+    size_t m_index;
+    MoveList m_badCaptures;
+    size_t m_badIndex;
+};
+
+#endif //MOVEPICKER_H
@@ -3,87 +3,230 @@
 
 #include "Constants.h"
 
+#include <cassert>
 #include <string>
+#include <vector>
+
+//Neurons of the first hidden layer, set by the build (CMake NNUE_HIDDEN): it must match the network file
+#ifndef NNUE_HIDDEN
+    #define NNUE_HIDDEN 128
+#endif
 
-const int NNUE_SIZE = 128;
 const int NNUE_FEATURES = 32*64*5*2; //kingBuckets * square * pieceType * color
 const int CONVERSION_FACTOR = __INT16_MAX__ / 3;
 
-struct Network;
+//Layer 1 is kept in int16 with less precision than in the file (CONVERSION_FACTOR), to make room
+//in the int16 accumulator: values within [-24, 24) are exact sums of the weights, with no overflow
+const int ACCUMULATOR_SHIFT = 3;
+constexpr float ACCUMULATOR_SCALE = (float)CONVERSION_FACTOR / (1 << ACCUMULATOR_SHIFT);
+
+//Hidden layers are quantized: activations in uint8 [0, ACTIVATION_ONE] after the clipped ReLU,
+//weights in int8 and biases/outputs in int32 (units of 1/WEIGHT_SCALE and 1/(ACTIVATION_ONE*WEIGHT_SCALE))
+const int ACTIVATION_ONE = 127;
+const int WEIGHT_SCALE = 64;
+const int WEIGHT_SHIFT = 6; //log2(WEIGHT_SCALE)
+//Layer 1 activation: (accumulator * ACTIVATION_MULTIPLIER) >> 15 rounded, as mulhrs
+constexpr int ACTIVATION_MULTIPLIER = (int)(ACTIVATION_ONE * 32768 / ACCUMULATOR_SCALE + 0.5f);
+
+const int ACCUMULATOR_STACK_SIZE = 256; //plies from the root of the search
+const int MAX_DIRTY_PIECES = 3; //a capture promotion: pawn, promoted piece and captured piece
+const int NO_SQUARE = -1;
+const int KING_BUCKETS_COUNT = 32;
+const int BATCH_BLOCK_SIZE = 16; //positions that go through layers 2 and 3 together
+
+class Board;
+
+//Network architecture
+enum NNUE_LAYER { L1, L2, L3, L4, NNUE_LAYERS };
+enum PARAMETER_TYPE { W, B, PARAMETER_TYPES };
+enum DIMENSIONS { ROW, COL, DIMENSIONS };
+
+//Layer sizes, known at compile time: the kernels are instantiated (and unrolled) for each layer
+template<uint FEATURES, uint HIDDEN, uint HIDDEN2, uint HIDDEN3>
+struct NetworkArchitecture {
+    static_assert(HIDDEN % 64 == 0 && HIDDEN2 % 32 == 0 && HIDDEN3 % 32 == 0, "sizes of the SIMD kernels");
+
+    static constexpr uint ARCH[NNUE_LAYERS][DIMENSIONS] = {
+        {FEATURES, HIDDEN},  //Layer1
+        {2*HIDDEN, HIDDEN2}, //Layer2
+        {HIDDEN2, HIDDEN3},  //Layer3
+        {HIDDEN3, 1}         //Layer4
+    };
+    static constexpr uint ARCH_DIMENSIONS[NNUE_LAYERS][PARAMETER_TYPES] = {
+        {ARCH[L1][ROW] * ARCH[L1][COL], ARCH[L1][COL]},
+        {ARCH[L2][ROW] * ARCH[L2][COL], ARCH[L2][COL]},
+        {ARCH[L3][ROW] * ARCH[L3][COL], ARCH[L3][COL]},
+        {ARCH[L4][ROW] * ARCH[L4][COL], ARCH[L4][COL]},
+    };
+};
+
+//Layer 2 is computed only for its non-zero inputs, in blocks of 4: its weights are stored
+//by columns of a block, [input / 4][output][input % 4]. The other layers by rows, [output][input]
+constexpr uint SparseWeightIndex(uint input, uint output, uint dimOutput) {
+    return ((input / 4) * dimOutput + output) * 4 + input % 4;
+}
+
+//Parameters as they are used by the inference
+template<typename Arch>
+struct alignas(64) QuantizedNetwork {
+    i16   w1[ Arch::ARCH_DIMENSIONS[L1][W] ]; //in ACCUMULATOR_SCALE units
+    i16   b1[ Arch::ARCH_DIMENSIONS[L1][B] ];
+    i8    w2[ Arch::ARCH_DIMENSIONS[L2][W] ]; //in WEIGHT_SCALE units, SparseWeightIndex
+    int   b2[ Arch::ARCH_DIMENSIONS[L2][B] ]; //in ACTIVATION_ONE * WEIGHT_SCALE units
+    i8    w3[ Arch::ARCH_DIMENSIONS[L3][W] ];
+    int   b3[ Arch::ARCH_DIMENSIONS[L3][B] ];
+    i8    w4[ Arch::ARCH_DIMENSIONS[L4][W] ];
+    int   b4[ Arch::ARCH_DIMENSIONS[L4][B] ];
+};
+
+//Parameters of the float file (layer 1 in CONVERSION_FACTOR units)
+template<typename Arch>
+struct FloatNetwork {
+    int16_t w1[ Arch::ARCH_DIMENSIONS[L1][W] ];
+    float b1[ Arch::ARCH_DIMENSIONS[L1][B] ];
+    float w2[ Arch::ARCH_DIMENSIONS[L2][W] ];
+    float b2[ Arch::ARCH_DIMENSIONS[L2][B] ];
+    float w3[ Arch::ARCH_DIMENSIONS[L3][W] ];
+    float b3[ Arch::ARCH_DIMENSIONS[L3][B] ];
+    float w4[ Arch::ARCH_DIMENSIONS[L4][W] ];
+    float b4[ Arch::ARCH_DIMENSIONS[L4][B] ];
+};
+
+//The architecture of this build
+typedef NetworkArchitecture<NNUE_FEATURES, NNUE_HIDDEN, 32, 32> Architecture;
+typedef QuantizedNetwork<Architecture> Network;
+typedef FloatNetwork<Architecture> NetworkStorage;
+
+inline constexpr const uint (&ARCH)[NNUE_LAYERS][DIMENSIONS] = Architecture::ARCH;
+inline constexpr const uint (&ARCH_DIMENSIONS)[NNUE_LAYERS][PARAMETER_TYPES] = Architecture::ARCH_DIMENSIONS;
+const int NNUE_SIZE = ARCH[L1][COL];
+
+//A piece changed by a move: fromSq is NO_SQUARE when it is added, toSq when it is removed
+struct DirtyPiece {
+    int color;
+    int pieceType;
+    int fromSq;
+    int toSq;
+};
+
+//Accumulator of the position at a ply, computed only if the position is evaluated
+struct AccumulatorState {
+    alignas(64) i16 accumulator[2][NNUE_SIZE];
+    bool computed[2];
+    bool refresh[2]; //the king of this perspective moved
+    int numDirty;
+    DirtyPiece dirty[MAX_DIRTY_PIECES];
+};
+
+//Last accumulator refreshed with a king bucket ("Finny table"), and its pieces
+struct RefreshEntry {
+    alignas(64) i16 accumulator[NNUE_SIZE];
+    Bitboard pieces[2][5]; //[color][pieceType from 0]
+};
+
+int QuantizeNetwork(const NetworkStorage& storage, Network& network); //returns the number of saturated parameters
+
+//The network is shared by all the boards, and read-only while they are evaluated.
+//Two file formats are loaded: the float NetworkStorage (quantized at startup into a Network of the engine),
+//and the quantized one of Save, which is memory-mapped as it is: no conversion, and the
+//processes that load the same file share its pages.
+//The default network (empty path, or EMBEDDED_NETWORK) is the one linked into the binary, in the
+//quantized format and used in place. Without one, it is read from the working directory
+const std::string EMBEDDED_NETWORK = "<embedded>";
 
+namespace NNUENetwork {
+    void Load(std::string filepath = "");
+    bool Save(std::string filepath, const Network& network);
+    void SetNetwork(const Network& network); //a copy is used, as a loaded float file (tests and tools)
+    bool IsLoaded();
+    bool IsMapped();
+    std::string GetPath();
+
+    //Quantized file linked into the binary by the build (CMake NNUE_EMBED): nullptr if there is none.
+    //Defined by the network library (src/nnue_embed) that the executable links
+    const u8* EmbeddedData();
+    u64 EmbeddedSize();
+
+    //Network in use, read by the kernels: the one quantized from a float file (or set), a mapped file or the embedded one
+    extern const Network* weights;
+}
+
+//Accumulators of a board, owned by it: each board (and so each search thread) has its own state
 class NNUE {
 public:
     NNUE();
-    void Load(std::string filepath = "");
-    bool IsLoaded() const { return m_isLoaded; }
-    std::string GetPath() const { return m_filepath; }
+    //A copy doesn't take the accumulator stack (most of the size of a Board): it is refreshed when evaluated
+    NNUE(const NNUE& other);
+    NNUE& operator=(const NNUE& other);
 
-    int Evaluate(int color);
+    int Evaluate(const Board& board); //from the point of view of the active player
 
-    void SetPieces(int color, uint64_t& pieces);
-    void SavePosition(int ply);
+    void Reset(int ply); //new root: full update of the position of the board at 'ply'
+    void NewPosition(int ply); //after a move to 'ply', before its Inputs_ changes
     void RestorePosition(int ply);
 
+    //The changes are recorded, and applied by ComputeAccumulator when the position is evaluated
     void Inputs_FullUpdate();
+    void Inputs_Refresh(int perspective); //after a move of the king of 'perspective'
     void Inputs_AddPiece(int color, int pieceType, int square);
     void Inputs_RemovePiece(int color, int pieceType, int square);
     void Inputs_MovePiece(int color, int pieceType, int fromSq, int toSq);
 
-private:
-    //Helpers
-    float Clamp(float n);
-    void ComputeLayer(float* inputLayer, float* outputLayer, float* biases, float* weights, int dimInput, int dimOutput, bool with_ReLU);
+    void ComputeAccumulator(const Board& board);
+    const i16* Accumulator(int color) const { assert(m_states[m_index].computed[color]); return m_states[m_index].accumulator[color]; }
 
-    //Current state
-    Bitboard* m_pieces[2];
-    float     m_accumulator[2][NNUE_SIZE];
-    //Backups
-    float     m_backupAccumulator[MAX_PLY][2][NNUE_SIZE];
+    //Also used by NNUEBatch
+    static int Feature(int perspective, int kingBucket, int color, int pieceType, int square);
+    template<int DIM> static void ActivateLayer(const int* input, u8* output);
 
-    bool m_isLoaded;
-    std::string m_filepath;
+private:
+    //Helpers
+    void AddDirtyPiece(int color, int pieceType, int fromSq, int toSq);
+    void RefreshAccumulator(const Board& board, AccumulatorState& state, int perspective);
+    static int KingBucket(const Board& board, int perspective);
+
+    //Stack of the positions from the root (m_rootPly) to the current one (m_index)
+    int m_rootPly;
+    int m_index;
+    AccumulatorState m_states[ACCUMULATOR_STACK_SIZE];
+    RefreshEntry m_refreshTable[2][KING_BUCKETS_COUNT];
 };
 
-//Network architecture
-enum NNUE_LAYER { L1, L2, L3, L4, NNUE_LAYERS };
-enum PARAMETER_TYPE { W, B, PARAMETER_TYPES };
-enum DIMENSIONS { ROW, COL, DIMENSIONS };
-
-constexpr uint ARCH[NNUE_LAYERS][DIMENSIONS] = {
-    {NNUE_FEATURES, NNUE_SIZE}, //Layer1
-    {2*NNUE_SIZE, 32},          //Layer2
-    {32, 32},                   //Layer3
-    {32, 1}                     //Layer4
-};
-constexpr uint ARCH_DIMENSIONS[NNUE_LAYERS][PARAMETER_TYPES] = {
-    {ARCH[L1][ROW] * ARCH[L1][COL], ARCH[L1][COL]},
-    {ARCH[L2][ROW] * ARCH[L2][COL], ARCH[L2][COL]},
-    {ARCH[L3][ROW] * ARCH[L3][COL], ARCH[L3][COL]},
-    {ARCH[L4][ROW] * ARCH[L4][COL], ARCH[L4][COL]},
+//Active features of a position from both perspectives: the input of a batch evaluation
+struct BatchPosition {
+    int color; //active player
+    int numFeatures; //the same from both perspectives
+    int features[2][32]; //[perspective]
 };
 
-struct Network {
-    float w1[ ARCH_DIMENSIONS[L1][W] ];
-    float b1[ ARCH_DIMENSIONS[L1][B] ];
-    float w2[ ARCH_DIMENSIONS[L2][W] ];
-    float b2[ ARCH_DIMENSIONS[L2][B] ];
-    float w3[ ARCH_DIMENSIONS[L3][W] ];
-    float b3[ ARCH_DIMENSIONS[L3][B] ];
-    float w4[ ARCH_DIMENSIONS[L4][W] ];
-    float b4[ ARCH_DIMENSIONS[L4][B] ];
-};
-struct NetworkStorage {
-    int16_t w1[ ARCH_DIMENSIONS[L1][0] ];
-    float b1[ ARCH_DIMENSIONS[L1][1] ];
-    float w2[ ARCH_DIMENSIONS[L2][0] ];
-    float b2[ ARCH_DIMENSIONS[L2][1] ];
-    float w3[ ARCH_DIMENSIONS[L3][0] ];
-    float b3[ ARCH_DIMENSIONS[L3][1] ];
-    float w4[ ARCH_DIMENSIONS[L4][0] ];
-    float b4[ ARCH_DIMENSIONS[L4][1] ];
+//Evaluation of many independent positions (offline scoring), each one as NNUE::Evaluate.
+//Layer 1 is a gather of the weights of the active features, with no accumulator state.
+//Layers 2 and 3 are matrix-matrix products over blocks of BATCH_BLOCK_SIZE positions (ComputeLayerBatch):
+//a column of weights is loaded once for several positions. The positions are split among 'threads' (0: one per core)
+namespace NNUEBatch {
+    BatchPosition FromBoard(const Board& board);
+    bool FromFen(const std::string& fen, BatchPosition& position); //false if the pieces are not valid
+    std::vector<int> Evaluate(const std::vector<BatchPosition>& positions, int threads = 0);
+    std::vector<int> Evaluate(const std::vector<std::string>& fens, int threads = 0); //0 for the invalid fens
+}
+
+//Header of the quantized format, followed by the bytes of a Network.
+//The version changes with the layout or the quantization of Network
+const char NETWORK_MAGIC[4] = { 'C', 'S', 'N', 'N' };
+const u32 NETWORK_VERSION = 2; //2: layer 2 by columns
+
+struct alignas(64) NetworkHeader {
+    char magic[4];
+    u32 version;
+    u32 features; //architecture
+    u32 hidden;
+    u32 layer2;
+    u32 layer3;
+    u32 accumulatorShift; //quantization
+    u32 weightShift;
+    u64 size; //sizeof(Network)
 };
+static_assert(sizeof(NetworkHeader) == 64); //the Network that follows is aligned in the mapping
 
-inline Network m_network;
-inline NNUE nnue;
 
 #endif //NNUE_H
@@ -0,0 +1,43 @@
+#ifndef NNUEKERNELS_H
+#define NNUEKERNELS_H
+
+#include "Constants.h"
+#include "NNUE.h"
+
+#include <string>
+
+enum SIMD_LEVEL { SIMD_SCALAR, SIMD_SSE41, SIMD_AVX2, SIMD_AVX512, SIMD_AVX512_VNNI, SIMD_LEVELS };
+
+//Inference kernels of the NNUE, with a version for each instruction set.
+//The best version supported by the CPU is selected at startup, so the same binary runs on any x86-64
+namespace NNUEKernels {
+    //output = input + the layer 1 weights of the added features - the ones of the removed features
+    typedef void (*UpdateAccumulatorFn)(const i16* input, i16* output, const int* added, int numAdded, const int* removed, int numRemoved);
+    //Clipped ReLU of the accumulator to uint8 [0, ACTIVATION_ONE]
+    typedef void (*ActivateAccumulatorFn)(const i16* accumulator, u8* output);
+    //output = biases + weights * input, with a row of weights per output.
+    //Instantiated for the sizes of each layer of the Architecture. Layer 2 skips the inputs that are zero,
+    //with its weights by columns (SparseWeightIndex)
+    typedef void (*ComputeLayerFn)(const u8* input, int* output, const int* biases, const i8* weights);
+    //The same for the BATCH_BLOCK_SIZE positions of a batch block (matrix-matrix), with the weights by columns
+    //(SparseWeightIndex): each column is loaded once for a tile of positions and accumulated into all their outputs.
+    //The input rows are 'inputStride' bytes apart, the output rows are the outputs of the layer
+    typedef void (*ComputeLayerBatchFn)(const u8* input, int inputStride, int* output, const int* biases, const i8* weights);
+
+    struct Kernels {
+        SIMD_LEVEL level;
+        UpdateAccumulatorFn UpdateAccumulator;
+        ActivateAccumulatorFn ActivateAccumulator;
+        ComputeLayerFn ComputeLayer[NNUE_LAYERS]; //[L2, L4]
+        ComputeLayerBatchFn ComputeLayerBatch[NNUE_LAYERS]; //[L2, L3]: layer 4 is a dot product per position
+    };
+    extern Kernels kernels;
+
+    void Init(); //best level supported by the CPU
+    void Init(SIMD_LEVEL level);
+
+    SIMD_LEVEL DetectLevel();
+    std::string LevelName(SIMD_LEVEL level);
+}
+
+#endif //NNUEKERNELS_H
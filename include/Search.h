@@ -7,9 +7,13 @@
 #include "Move.h"
 #include "Utils.h"
 
+#include <atomic>
+#include <memory>
+#include <thread>
 #include <vector>
 
 const int MAX_ROOTMOVES = 256;
+const int MAX_THREADS = 256;
 
 struct Limits {
     bool infinite = false;
@@ -39,7 +43,7 @@ private:
 
 class Search {
 public:
-    Search();
+    explicit Search(bool isHelper = false);
 
     //Start search
     void IterativeDeepening(Board &board);
@@ -49,6 +53,14 @@ public:
     void Stop() { m_stop = true; }
     void DebugMode() { m_debugMode = true; }
 
+    //Pawn hash and eval cache of every thread (the stored evals belong to the current evaluation)
+    void ClearEvalTables();
+    EvalCache& GetEvalCache() { return m_evalCache; }
+
+    //Threads (Lazy SMP)
+    void SetThreads(int threads);
+    int GetThreads() const { return 1 + m_helpers.size(); }
+
     //Limits
     Limits GetLimits() { return m_limits; }
     void AllocateLimits(Board &board, Limits limits);
@@ -60,7 +72,7 @@ public:
     //Getters
     Move BestMove() const { return m_bestMove; };
     int BestScore() const { return m_bestScore; };
-    u64 GetNodes() const { return m_nodes; };
+    u64 GetNodes() const { return TotalNodes(); };
     int GetNps() const { return m_nps; };
 
     //Interface
@@ -74,12 +86,20 @@ private:
     int LateMoveReductions(int moveScore, int depth, int moveNumber, bool isPV);
 
     bool TimeOver();
-    bool NodeLimit() { return m_nodes >= m_forcedNodes; };
+    bool NodeLimit();
+    //Only this thread writes its counter (others read it for the total): no locked increment
+    void IncrementNodes() { m_nodes.store(m_nodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
 
     //IterativeDeepening methods
     void ClearSearch();
     void UciOutput(std::string PV);
 
+    //Lazy SMP
+    void StartHelpers(Board &board);
+    void StopHelpers();
+    Search* BestThread();
+    u64 TotalNodes() const;
+
     //Debug
     void ShowDebugInfo();
 
@@ -92,8 +112,9 @@ private:
 
     //Info variables
     int m_depth;
+    int m_completedDepth;
     int64_t m_elapsedTime;
-    u64 m_nodes;
+    std::atomic<u64> m_nodes;
     int m_nps;
     int m_bestScore;
     Move m_bestMove;
@@ -101,7 +122,7 @@ private:
 
     //Time management
     Utils::Clock m_clock;
-    bool m_stop;
+    std::atomic<bool> m_stop;
     int m_nodesTimeCheck;
 
     //Helpers
@@ -114,6 +135,16 @@ private:
     //Heuristics
     Heuristics m_heuristics;
 
+    //Evaluation tables of this thread, kept between searches
+    PawnHash m_pawnHash;
+    EvalCache m_evalCache;
+
+    //Lazy SMP: helpers share the transposition table, each one with its own board and heuristics
+    bool m_isHelper;
+    int m_threadId;
+    std::vector<std::unique_ptr<Search>> m_helpers;
+    std::vector<std::thread> m_helperThreads;
+
     //Debug
     bool m_debugMode;
     SearchDebug m_debug;
@@ -20,6 +20,7 @@ private:
     void Position(std::istringstream &stream);
     void SetOption(std::istringstream &stream);
     void StartSearch();
+    void EvalBench(int iterations);
 
     Board m_board;
     Search m_search;
@@ -1,9 +1,12 @@
 #include "Attacks.h"
 #include "BitboardUtils.h"
+#include <cstdlib>
 
 Bitboard Attacks::m_Rays[8][64] = {{0}}; //[DIRECTION][SQUARE]
 Bitboard Attacks::m_NonSlidingAttacks[2][8][64] = {{{0}}}; //[COLOR][PIECE][SQUARE]
 Bitboard Attacks::m_Between[64][64] = {{0}}; //[SQUARE][SQUARE]
+Attacks::Magic Attacks::m_BishopMagics[64];
+Attacks::Magic Attacks::m_RookMagics[64];
 
 //Private functions
 namespace {
@@ -61,6 +64,84 @@ namespace {
 
         return ray;
     }
+
+    //Sizes: sum over the squares of 2^(relevant blockers)
+    const int BISHOP_TABLE_SIZE = 5248;
+    const int ROOK_TABLE_SIZE = 102400;
+    Bitboard BishopTable[BISHOP_TABLE_SIZE];
+    Bitboard RookTable[ROOK_TABLE_SIZE];
+
+    //Magic numbers: found by trial and error (sparse random numbers), checked to have no
+    //harmful collisions. Not used with PEXT
+    const u64 BISHOP_MAGICS[64] = {
+        0x0c08081028882700, 0x0208088820424040, 0x2188480100202561, 0x0004104610800140,
+        0x9004504100002000, 0x0a010108c0010041, 0x3800491028200000, 0x0000802101202002,
+        0x81020410b0810100, 0x0408082808404040, 0x0106220084008008, 0x0040182841001082,
+        0x158404504000800e, 0x0888810108432808, 0x0100020811180808, 0x0801420a02410400,
+        0x1320559102103101, 0x0182002002240102, 0xa910000200260020, 0x0008010628210000,
+        0x8002000402114461, 0x0000204410080800, 0x0400500205100900, 0x2002014880840100,
+        0x01e1100108102148, 0x0410090044115400, 0x4004084010104040, 0x0202002008008220,
+        0x0001001105004020, 0x0001081022080400, 0x2018842000820806, 0x40008e0000210401,
+        0x2314104102082200, 0x0002100500101109, 0x1224040201411200, 0x0202004040040102,
+        0x0040002022020080, 0x2020004081210080, 0x0442020404004401, 0x0408c08a00090104,
+        0x0898a21821004003, 0xb004189210424820, 0x8008131088031000, 0x0009010148010500,
+        0x2100084104000040, 0x110102108200a100, 0x0010120801144060, 0x0002020a24200200,
+        0x0020880808040000, 0x0a8b041201040103, 0x0140120205114002, 0x6282000242021201,
+        0x080080140d0c0122, 0x0181102011810200, 0x0804041032420400, 0x0020842c00414142,
+        0x06498028010c2082, 0x0062202084042010, 0x8100000211008800, 0x6000000000840400,
+        0x0018000008210100, 0x00040011a0010100, 0x0820090210020204, 0x0402482804858200
+    };
+    const u64 ROOK_MAGICS[64] = {
+        0x0280132180004001, 0x0140001000200040, 0x0880200010000880, 0x2080080005801000,
+        0x0200041020080200, 0x0200041041084200, 0x0400080081124410, 0x2180042100004080,
+        0x8000800099644000, 0x0802003040820100, 0x0105801001862000, 0x0101002008100100,
+        0x1000800400080080, 0x0804800200040080, 0x2001800200800900, 0x00160004088204c1,
+        0x228000c001402000, 0x8510004000200050, 0x3001848020029000, 0x0280808010000801,
+        0x0109010010040800, 0x8000808004000200, 0x8000040081021028, 0x40040a0009004884,
+        0x80c0004280008035, 0x0010004040002000, 0x1101200500410070, 0x8410100080080080,
+        0x000c080080800400, 0x4012008080040002, 0x4000040101000200, 0x0061010200008044,
+        0x0080804010800020, 0x3000201008400040, 0x4112008012002444, 0x0848000880801000,
+        0x00a8008008800400, 0x200200280a00500c, 0x080a221024004801, 0xc400008042000104,
+        0x8000400080028022, 0x0220008040018020, 0x4000200011010040, 0x10060040210a0010,
+        0x40820020904a0004, 0x0030040002008080, 0x0200020801840010, 0x0084c04100820004,
+        0x4802010080c2a600, 0x0000400080201880, 0x2040801000200080, 0x0180200842001200,
+        0x0013510008000500, 0x0182000c00808a80, 0x1000524821302400, 0x3800040108488200,
+        0x104a004810210082, 0x0004210010420082, 0xc424110008200241, 0x90101000a0088501,
+        0x0182000420100802, 0x4822001001080402, 0x05d0080090012204, 0x2008140089042846
+    };
+
+    //Fills the attack tables. The magics are checked in every build: a harmful collision would
+    //silently give wrong attacks
+    void InitMagics(PIECE_TYPE pieceType, Attacks::Magic magics[], Bitboard table[]) {
+        Bitboard* attacks = table;
+        for(int square = 0; square < 64; square++) {
+            Bitboard edges = ((MaskRank[RANK1] | MaskRank[RANK8]) & ~MaskRank[Rank(square)])
+                           | ((MaskFile[FILEA] | MaskFile[FILEH]) & ~MaskFile[File(square)]);
+
+            Attacks::Magic& m = magics[square];
+            m.mask = Attacks::AttacksSlidingClassical(pieceType, square, ZERO) & ~edges;
+            m.magic = pieceType == BISHOP ? BISHOP_MAGICS[square] : ROOK_MAGICS[square];
+            m.shift = 64 - BitboardUtils::PopCount(m.mask);
+            m.attacks = attacks;
+
+            //All the subsets of the mask (Carry-Rippler)
+            Bitboard blockers = ZERO;
+            do {
+                Bitboard reference = Attacks::AttacksSlidingClassical(pieceType, square, blockers);
+                u32 index = m.Index(blockers);
+                if(m.attacks[index] && m.attacks[index] != reference) { //harmless collisions only
+                    std::cout << "ERROR: bad " << (pieceType == BISHOP ? "bishop" : "rook")
+                              << " magic for square " << square << std::endl;
+                    std::abort();
+                }
+                m.attacks[index] = reference;
+                blockers = (blockers - m.mask) & m.mask;
+            } while(blockers);
+
+            attacks += ONE << BitboardUtils::PopCount(m.mask);
+        }
+        assert(attacks - table == (pieceType == BISHOP ? BISHOP_TABLE_SIZE : ROOK_TABLE_SIZE));
+    }
 }
 
 void Attacks::Init() {
@@ -144,6 +225,9 @@ void Attacks::Init() {
         }
     }
 
+    //Sliding attacks (after the rays)
+    InitMagics(BISHOP, m_BishopMagics, BishopTable);
+    InitMagics(ROOK, m_RookMagics, RookTable);
 }
 
 Bitboard Attacks::GetRay(DIRECTIONS direction, int square) {
@@ -159,8 +243,19 @@ Bitboard Attacks::AttacksKnights(int square) {
 Bitboard Attacks::AttacksKing(int square) {
     return m_NonSlidingAttacks[WHITE][KING][square];
 }
-//Classical approach
 Bitboard Attacks::AttacksSliding(PIECE_TYPE pieceType, int square, Bitboard blockers) {
+    switch(pieceType) {
+        case BISHOP: return m_BishopMagics[square].attacks[ m_BishopMagics[square].Index(blockers) ];
+        case ROOK:   return m_RookMagics[square].attacks[ m_RookMagics[square].Index(blockers) ];
+        case QUEEN:  return m_BishopMagics[square].attacks[ m_BishopMagics[square].Index(blockers) ]
+                          | m_RookMagics[square].attacks[ m_RookMagics[square].Index(blockers) ];
+        default: assert(false);
+    };
+    return ZERO;
+}
+
+//Classical approach
+Bitboard Attacks::AttacksSlidingClassical(PIECE_TYPE pieceType, int square, Bitboard blockers) {
     Bitboard attacks = ZERO;
 
     switch(pieceType) {
@@ -202,8 +297,8 @@ Bitboard Attacks::AttacksSliding(PIECE_TYPE pieceType, int square, Bitboard bloc
             break;
             
         case QUEEN: {
-            attacks |= AttacksSliding(BISHOP, square, blockers);
-            attacks |= AttacksSliding(ROOK, square, blockers);
+            attacks |= AttacksSlidingClassical(BISHOP, square, blockers);
+            attacks |= AttacksSlidingClassical(ROOK, square, blockers);
         }
             break;
 
@@ -42,7 +42,7 @@ u64 Board::Perft(int depth) {
     u64 nodes = 0;
 
     MoveGenerator generator;
-    MoveList moves = generator.GenerateMoves(*this);
+    MoveList& moves = generator.GenerateMoves(*this);
 
     if(depth == 0) return 1;
     if(depth == 1) return moves.size();
@@ -68,7 +68,7 @@ void Board::Divide(int depth) {
     u64 nodesTotal = 0;
 
     MoveGenerator generator;
-    MoveList moves = generator.GenerateMoves(*this);
+    MoveList& moves = generator.GenerateMoves(*this);
 
     for(auto &move : moves) {
         MakeMove(move);
@@ -120,11 +120,11 @@ void Board::Print(bool bits) const {
 
 void Board::ShowHashMoves() {
     MoveGenerator gen;
-    MoveList moves = gen.GenerateMoves(*this);
+    MoveList& moves = gen.GenerateMoves(*this);
 
     for(auto move : moves)  {
         MakeMove(move);
-        TTEntry* ttEntry = Hash::tt.ProbeEntry(ZKey(), 0);
+        std::optional<TTEntry> ttEntry = Hash::tt.ProbeEntry(ZKey(), 0);
         if(ttEntry) {
             P(move.Notation() << " " << ttEntry->type << "\t" << ttEntry->score);
         }
@@ -140,13 +140,20 @@ void Board::ShowHistory() {
 
 void Board::ShowMoves() {
     MoveGenerator moveGenerator;
-    MoveList moves = moveGenerator.GenerateMoves(*this);
+    MoveList& moves = moveGenerator.GenerateMoves(*this);
     for(auto move : moves ) {
         move.Print();
     }
     P("size: " << moves.size());
 }
 
+void Board::ResetNNUE() {
+    if(UCI_CLASSICAL_EVAL)
+        return;
+
+    m_nnue.Reset(m_ply);
+}
+
 //Static Exchange Evaluator
 int Board::SEE(Move move) {
     //Retrieve info
@@ -484,11 +491,7 @@ void Board::InitStateAndHistory() {
 
     m_checkCalculated = false;
 
-    if(!UCI_CLASSICAL_EVAL) {
-        nnue.SetPieces(WHITE, m_pieces[WHITE][NO_PIECE]);
-        nnue.SetPieces(BLACK, m_pieces[BLACK][NO_PIECE]);
-        nnue.Inputs_FullUpdate();
-    }
+    ResetNNUE();
 }
 
 bool Board::CheckIntegrity() const {
@@ -325,12 +325,12 @@ void Evaluation::EvalPawns(const Board &board, Score& score) {
                         << ", hit " << test_hit \
                         << ", miss " << test_miss \
                         << ", rate " << 100 * (float)test_hit / test_total << "%" \
-                        << ", fill " << 100 * Hash::pawnHash.Occupancy() << "%");
+                        << ", fill " << 100 * (Hash::pawnHash ? Hash::pawnHash->Occupancy() : 0) << "%");
         }
         test_total++;
     );
 
-    PawnEntry* pawnEntry = Hash::pawnHash.ProbeEntry( board.PawnKey() );
+    PawnEntry* pawnEntry = Hash::pawnHash ? Hash::pawnHash->ProbeEntry( board.PawnKey() ) : nullptr;
     if(pawnEntry) {
         D(test_hit++);
 
@@ -346,7 +346,8 @@ void Evaluation::EvalPawns(const Board &board, Score& score) {
         int scoreEg = whiteEval.eg - blackEval.eg;
 
         //Store in hash
-        Hash::pawnHash.AddEntry(board.PawnKey(), scoreMg, scoreEg);
+        if(Hash::pawnHash)
+            Hash::pawnHash->AddEntry(board.PawnKey(), scoreMg, scoreEg);
 
         score.Add(scoreMg, scoreEg);
     }
@@ -517,13 +518,21 @@ int Evaluation::Evaluate(const Board& board) {
     if( InsufficientMaterial(board) )
         return 0;
 
+    EvalCache* evalCache = Hash::evalCache;
+    if(evalCache) {
+        std::optional<int> cachedEval = evalCache->ProbeEntry( board.ZKey() );
+        if(cachedEval)
+            return *cachedEval;
+    }
+
     int eval;
     if(UCI_CLASSICAL_EVAL) {
         eval = ClassicalEvaluation(board);
     } else {
-        int color = board.ActivePlayer();
-        eval = nnue.Evaluate(color);
+        eval = board.GetNNUE().Evaluate(board);
     }
 
+    if(evalCache)
+        evalCache->AddEntry(board.ZKey(), eval);
     return eval;
 }
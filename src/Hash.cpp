@@ -1,32 +1,123 @@
 #include "Hash.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#ifdef _MSC_VER
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
 // Extern declarations
 TT Hash::tt;
-PawnHash Hash::pawnHash;
+thread_local PawnHash* Hash::pawnHash = nullptr;
+thread_local EvalCache* Hash::evalCache = nullptr;
 
 // -- Transposition table
 
+//Private functions
+namespace {
+    inline u16 KeyCheck(u64 zkey) {
+        return (u16)zkey;
+    }
+    inline u16 Fold16(u64 data) {
+        return (u16)(data ^ (data >> 16) ^ (data >> 32) ^ (data >> 48));
+    }
+
+    //Big tables are aligned to (and sized in multiples of) 2 MB, so the kernel can back them with
+    //transparent huge pages: fewer TLB misses on random accesses. Returns nullptr on failure
+    const u64 HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    u64 AllocationBytes(u64 bytes) {
+        const u64 alignment = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 64;
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    void* AlignedAlloc(u64 bytes) {
+        const u64 alignment = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 64;
+#ifdef _MSC_VER
+        return _aligned_malloc(bytes, alignment);
+#else
+        void* mem = std::aligned_alloc(alignment, bytes);
+    #ifdef MADV_HUGEPAGE
+        if(mem && alignment == HUGE_PAGE_SIZE)
+            madvise(mem, bytes, MADV_HUGEPAGE); //only a hint: ignore failures
+    #endif
+        return mem;
+#endif
+    }
+
+    void AlignedFree(void* mem) {
+#ifdef _MSC_VER
+        _aligned_free(mem);
+#else
+        std::free(mem);
+#endif
+    }
+}
+
 void TTEntry::Clear() {
-    zkey = 0;
+    key = 0;
+    bestMove = 0;
     score = 0;
+    eval = TT_NO_EVAL;
     depth = 0;
     type = TTENTRY_TYPE::NONE;
     age = 0;
-    bestMove = Move();
+}
+
+//0-15 bits: bestMove, 16-31 bits: score, 32-47 bits: eval, 48-55 bits: depth, 56-57 bits: type, 58-63 bits: age
+u64 TTEntry::Data() const {
+    return (u64)bestMove
+         | (u64)(u16)score << 16
+         | (u64)(u16)eval << 32
+         | (u64)depth << 48
+         | (u64)type << 56
+         | (u64)age << 58;
+}
+
+void TTEntry::SetData(u64 data) {
+    bestMove = (u16)data;
+    score = (i16)(data >> 16);
+    eval = (i16)(data >> 32);
+    depth = (u8)(data >> 48);
+    type = (data >> 56) & 0x3;
+    age = (data >> 58) & 0x3F;
 }
 
 TT::TT() {
-    m_entries = nullptr;
+    m_buckets = nullptr;
     SetSize(DEFAULT_HASH_SIZE);
 }
 
 TT::~TT() {
-    delete [] m_entries;
+    AlignedFree(m_buckets);
 }
 
+//Split across threads: zeroing (and first-touching) multi-GB tables is otherwise
+//slow enough to delay 'readyok'. Only called while no search is running
 void TT::Clear() {
-    for(u64 i=0; i < m_size; ++i) {
-        m_entries[i].Clear();
+    const u64 bucketsPerThread = std::max<u64>(CLEAR_MIN_BYTES_PER_THREAD / sizeof(TTBucket), 1);
+    const u64 threads = std::clamp<u64>(m_numBuckets / bucketsPerThread, 1, std::max(std::thread::hardware_concurrency(), 1u));
+    const u64 chunk = (m_numBuckets + threads - 1) / threads;
+
+    auto clearRange = [this](u64 begin, u64 end) {
+        std::memset(static_cast<void*>(m_buckets + begin), 0, (end - begin) * sizeof(TTBucket));
+    };
+
+    std::vector<std::thread> workers;
+    for(u64 t = 1; t < threads; t++) {
+        u64 begin = std::min(t * chunk, m_numBuckets);
+        u64 end = std::min(begin + chunk, m_numBuckets);
+        workers.emplace_back(clearRange, begin, end);
+    }
+    clearRange(0, std::min(chunk, m_numBuckets));
+
+    for(auto& worker : workers) {
+        worker.join();
     }
 }
 
@@ -50,59 +141,122 @@ int TT::ScoreFromHash(int score, int ply) {
     return score;
 }
 
-void TT::AddEntry(u64 zkey, int score, TTENTRY_TYPE type, Move bestMove, int depth, int ply, int age) {
+void TT::AddEntry(u64 zkey, int score, int eval, TTENTRY_TYPE type, Move bestMove, int depth, int ply, int age) {
     assert(abs(score) <= MATESCORE);
     assert(depth <= MAX_DEPTH);
 
-    u64 index = zkey % m_size;
+    TTBucket& bucket = GetBucket(zkey);
+    const u16 key = KeyCheck(zkey);
 
-    //Replacement scheme
-    if(age != m_entries[index].age || depth >= m_entries[index].depth) {
-        TTEntry entry;
-        entry.zkey = zkey;
-        entry.score = ScoreToHash(score, ply);
-        entry.depth = depth;
-        entry.type = type;
-        entry.age = age;
-        entry.bestMove = bestMove;
+    //Replacement scheme. A torn read only affects this decision
+    //1. The same position: overwrite, unless the stored search is much deeper
+    //2. Otherwise, the least valuable entry: shallow, from older searches, not exact
+    int replace = 0;
+    TTEntry replaced;
+    bool samePosition = false;
+    int lowestValue = INFINITE;
+    for(int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+        u64 data = bucket.data[i].load(std::memory_order_relaxed);
+        TTEntry current;
+        current.SetData(data);
+
+        if(data && (bucket.keys[i].load(std::memory_order_relaxed) ^ Fold16(data)) == key) {
+            if(type != TTENTRY_TYPE::EXACT && depth + 3 < current.depth)
+                return;
+            replace = i;
+            replaced = current;
+            samePosition = true;
+            break;
+        }
 
-        m_entries[index] = entry;
+        int relativeAge = (age - current.age) & 0x3F;
+        int value = data ? current.depth - 8 * relativeAge + 2 * (current.type == TTENTRY_TYPE::EXACT)
+                         : -INFINITE; //empty entry
+        if(value < lowestValue) {
+            lowestValue = value;
+            replace = i;
+            replaced = current;
+        }
     }
+
+    TTEntry entry;
+    entry.key = key;
+    entry.bestMove = bestMove.Compact();
+    entry.score = ScoreToHash(score, ply);
+    entry.eval = eval;
+    entry.depth = depth;
+    entry.type = type;
+    entry.age = age;
+
+    //Keep the old move of the same position if there is no new one (e.g. null-move cut-offs)
+    if(samePosition && bestMove.MoveType() == NULLMOVE)
+        entry.bestMove = replaced.bestMove;
+
+    u64 data = entry.Data();
+    bucket.data[replace].store(data, std::memory_order_relaxed);
+    bucket.keys[replace].store(key ^ Fold16(data), std::memory_order_relaxed);
 }
 
-TTEntry* TT::ProbeEntry(u64 zkey, int depth) {
-    u64 index = zkey % m_size;
-    TTEntry entry = m_entries[index];
-    if(entry.zkey == zkey && entry.depth >= depth) {
-        return &m_entries[index];
-    } else {
-        return nullptr;
+std::optional<TTEntry> TT::ProbeEntry(u64 zkey, int depth) {
+    const TTBucket& bucket = GetBucket(zkey);
+    const u16 key = KeyCheck(zkey);
+
+    for(int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+        u64 data = bucket.data[i].load(std::memory_order_relaxed);
+        u16 keyCheck = bucket.keys[i].load(std::memory_order_relaxed);
+
+        if(!data || (keyCheck ^ Fold16(data)) != key)
+            continue;
+
+        TTEntry entry;
+        entry.key = key;
+        entry.SetData(data);
+        if(entry.depth < depth)
+            return std::nullopt;
+
+        return entry;
     }
+    return std::nullopt;
 }
 
 int TT::OccupancyPerMil() {
     int count = 0;
     for(int i = 0; i < 1000; i++) {
-        count += (m_entries[i].zkey != 0);
+        count += (m_buckets[i / TT_BUCKET_ENTRIES].data[i % TT_BUCKET_ENTRIES].load(std::memory_order_relaxed) != 0);
     }
     return count;
 }
 
 u64 TT::NumEntries() {
     u64 count = 0;
-    for(u64 i = 0; i < m_size; ++i) {
-        count += (m_entries[i].zkey != 0);
+    for(u64 i = 0; i < m_numBuckets; ++i) {
+        for(int j = 0; j < TT_BUCKET_ENTRIES; j++) {
+            count += (m_buckets[i].data[j].load(std::memory_order_relaxed) != 0);
+        }
     }
     return count;
 }
 
-void TT::SetSize(int size) {  // size in MB
-    const u64 hashEntries = size * (1024*1024) / sizeof(TTEntry);
+void TT::SetSize(u64 size) {  // size in MB
+    size = std::clamp<u64>(size, 1, MAX_HASH_SIZE);
+    u64 hashBuckets = size * (1024*1024) / sizeof(TTBucket);
+    u64 bytes = AllocationBytes(hashBuckets * sizeof(TTBucket));
+
+    AlignedFree(m_buckets);
+    m_buckets = static_cast<TTBucket*>( AlignedAlloc(bytes) );
 
-    delete [] m_entries;
-    m_entries = new TTEntry[hashEntries];
-    
-    m_size = hashEntries;
+    //Not enough memory: fall back to the default size
+    if(!m_buckets) {
+        std::cout << "info string Could not allocate " << size << " MB for the hash table, using "
+                  << DEFAULT_HASH_SIZE << " MB" << std::endl;
+        hashBuckets = (u64)DEFAULT_HASH_SIZE * (1024*1024) / sizeof(TTBucket);
+        bytes = AllocationBytes(hashBuckets * sizeof(TTBucket));
+        m_buckets = static_cast<TTBucket*>( AlignedAlloc(bytes) );
+        assert(m_buckets);
+    }
+
+    m_numBuckets = hashBuckets;
+    m_size = hashBuckets * TT_BUCKET_ENTRIES;
     Clear();
 }
 
@@ -160,3 +314,44 @@ PawnEntry* PawnHash::ProbeEntry(u64 zkey) {
         return nullptr;
     }
 }
+
+// -- Eval cache
+
+void EvalEntry::Clear() {
+    zkey = 0;
+    eval = 0;
+}
+
+EvalCache::EvalCache() {
+    m_evalEntries = new EvalEntry[EVAL_CACHE_SIZE];
+    Clear();
+    ClearStats();
+}
+
+EvalCache::~EvalCache() {
+    delete [] m_evalEntries;
+}
+
+void EvalCache::Clear() {
+    for(u64 i=0; i < EVAL_CACHE_SIZE; ++i) {
+        m_evalEntries[i].Clear();
+    }
+}
+
+void EvalCache::AddEntry(u64 zkey, int eval) {
+    assert( abs(eval) <= MATESCORE );
+
+    EvalEntry& entry = m_evalEntries[zkey % EVAL_CACHE_SIZE];
+    entry.zkey = zkey;
+    entry.eval = eval;
+}
+
+std::optional<int> EvalCache::ProbeEntry(u64 zkey) {
+    m_probes++;
+    const EvalEntry& entry = m_evalEntries[zkey % EVAL_CACHE_SIZE];
+    if(entry.zkey != zkey)
+        return std::nullopt;
+
+    m_hits++;
+    return entry.eval;
+}
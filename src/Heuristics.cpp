@@ -8,13 +8,7 @@
 //Unnamed namespace (private functions)
 namespace {
 
-    void RateMoves(Board &board, MoveList& moveList, TT& tt, const Heuristics &heuristics, int ply) {
-        Move hashMove;
-        TTEntry* ttEntry = tt.ProbeEntry(board.ZKey(), 0); //shallowest
-        if(ttEntry) {
-            hashMove = ttEntry->bestMove;
-        }
-
+    void RateMoves(Board &board, MoveList& moveList, u16 hashMove, const Heuristics &heuristics, int ply) {
         Move killer1 = heuristics.killer.Primary(ply);
         Move killer2 = heuristics.killer.Secondary(ply);
         Move killer3, killer4;
@@ -26,59 +20,15 @@ namespace {
         for(auto &move : moveList) {
 
             //Hash move: 255 (max)
-            if(move == hashMove) {
+            if(move.Compact() == hashMove) {
                 move.SetScore(255);
                 continue;
             }
 
-            //Queen promotion captures: 254
-            //Queen promotions: 253
-            //Underpromotions: 0
-            if(move.IsPromotion()) {
-                if(move.MoveType() == PROMOTION_CAPTURE && move.PromotionType() == PROMOTION_QUEEN) {
-                    move.SetScore(254); continue;
-                }
-                else if(move.MoveType() == PROMOTION && move.PromotionType() == PROMOTION_QUEEN) {
-                    move.SetScore(253); continue;
-                }
-                else { //underpromotion
-                    move.SetScore(0); continue;
-                }
-            }
-
-            //SEE positive: [241, 249]
-            //SEE neutral: 240
-            //SEE negative: [181-189]
-            const bool useSEE = 1;
-            if(useSEE) {
-                PIECE_TYPE capturedType = move.CapturedType();
-                if(capturedType) {
-                    int see = board.SEE(move);
-
-                    if(see > 0) {
-                        int score = ((see - 1) * 8 / 1024) + 241;
-                        score = std::min(score, 249); 
-                        move.SetScore(score); continue;
-                    }
-                    else if(see == 0) {
-                        move.SetScore(240); continue;
-                    }
-                    else if(see < 0) {
-                        int score = ((see + 1) * 8 / 1024) + 189;
-                        score = std::max(score, 181);
-                        move.SetScore(score); continue;
-                    }
-                    
-                }
-            }
-            else {
-                //Captured piece: 200-236
-                PIECE_TYPE capturedType = move.CapturedType();
-                PIECE_TYPE pieceType = move.PieceType();
-                if(capturedType) {
-                    move.SetScore(200 + 6*capturedType - pieceType); //200 + capturedType
-                    continue;
-                }
+            //Promotions and captures: see CaptureScore
+            if(move.IsPromotion() || move.CapturedType()) {
+                move.SetScore(Sorting::CaptureScore(board, move));
+                continue;
             }
 
             //Killer heuristics: 190-194
@@ -100,14 +50,7 @@ namespace {
             }
 
             //History heuristics (1-180)
-            int historyScore = heuristics.history.Get(move, board.ActivePlayer());
-            int maxValue = heuristics.history.MaxValue();
-            const int maxScore = 180;
-            const int minScore = 1;
-            historyScore = minScore + historyScore * (maxScore-minScore) / (maxValue+1);
-            assert(historyScore >= minScore && historyScore <= maxScore);
-            move.SetScore(historyScore);
-
+            move.SetScore(Sorting::QuietScore(move, board.ActivePlayer(), heuristics));
         }
     }
 
@@ -166,6 +109,51 @@ namespace {
 } //unnamed namespace
 
 //Public Interface
+u8 Sorting::CaptureScore(Board &board, Move move) {
+    //Queen promotion captures: 254
+    //Queen promotions: 253
+    //Underpromotions: 0
+    if(move.IsPromotion()) {
+        if(move.MoveType() == PROMOTION_CAPTURE && move.PromotionType() == PROMOTION_QUEEN)
+            return 254;
+        else if(move.MoveType() == PROMOTION && move.PromotionType() == PROMOTION_QUEEN)
+            return 253;
+        else //underpromotion
+            return 0;
+    }
+
+    //En passant: as SEE neutral
+    if(move.MoveType() == ENPASSANT)
+        return 240;
+
+    //SEE positive: [241, 249]
+    //SEE neutral: 240
+    //SEE negative: [181-189]
+    int see = board.SEE(move);
+
+    if(see > 0) {
+        int score = ((see - 1) * 8 / 1024) + 241;
+        return std::min(score, 249);
+    }
+    else if(see == 0) {
+        return 240;
+    }
+    else {
+        int score = ((see + 1) * 8 / 1024) + 189;
+        return std::max(score, 181);
+    }
+}
+
+u8 Sorting::QuietScore(Move move, COLOR color, const Heuristics &heuristics) {
+    int historyScore = heuristics.history.Get(move, color);
+    int maxValue = heuristics.history.MaxValue();
+    const int maxScore = 180;
+    const int minScore = 1;
+    historyScore = minScore + historyScore * (maxScore-minScore) / (maxValue+1);
+    assert(historyScore >= minScore && historyScore <= maxScore);
+    return historyScore;
+}
+
 void Sorting::SortQuiescence(Board &board, MoveList &moveList) {
     RateQuiescence(board, moveList);
     std::sort(moveList.begin(), moveList.end(), ByScore);
@@ -177,7 +165,17 @@ void Sorting::SortEvasions(Board &board, MoveList &moveList) {
 }
 
 void Sorting::SortMoves(Board &board, MoveList& moveList, TT& tt, const Heuristics &heuristics, int ply) {
-    RateMoves(board, moveList, tt, heuristics, ply);
+    u16 hashMove = 0;
+    std::optional<TTEntry> ttEntry = tt.ProbeEntry(board.ZKey(), 0); //shallowest
+    if(ttEntry) {
+        hashMove = ttEntry->bestMove;
+    }
+
+    SortMoves(board, moveList, hashMove, heuristics, ply);
+}
+
+void Sorting::SortMoves(Board &board, MoveList& moveList, u16 hashMove, const Heuristics &heuristics, int ply) {
+    RateMoves(board, moveList, hashMove, heuristics, ply);
 
     std::sort(moveList.begin(), moveList.end(), ByScore);
 }
@@ -49,7 +49,7 @@ void Interface::Start(std::string fenString) {
         //Random move
         else if(input == "random") {
             MoveGenerator gen;
-            MoveList moves = gen.GenerateMoves(m_board);
+            MoveList& moves = gen.GenerateMoves(m_board);
 
             if(!moves.empty()) {
                 m_board.MakeMove( gen.RandomMove() );
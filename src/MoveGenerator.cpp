@@ -9,43 +9,46 @@ using namespace BitboardUtils;
 #include <algorithm>
 #include <iostream>
 
-const int MAX_MOVES_RESERVE = 256;
-const int MAX_CAPTURES_RESERVE = 64;
-
 //Legal moves
-MoveList MoveGenerator::GenerateMoves(Board &board) {
-    Init(board);
-    m_moves.reserve(MAX_MOVES_RESERVE);
-    m_generateQuiet = true;
+MoveList& MoveGenerator::GenerateMoves(Board &board) {
+    m_initialized = false;
+    Generate(board, GEN_ALL, ALL);
 
-    //Calculations
-    m_kingDangerSquares = GenerateKingDangerAttacks(board);
-    m_pinned = PinnedPieces(board, m_color);
+    return m_moves;
+}
 
-    if(board.IsCheck()) {
-        GenerateEvasionMoves(board);
-    } else {
-        GeneratePseudoMoves(board);
-    }
+MoveList& MoveGenerator::GenerateCaptures(Board &board) {
+    m_initialized = false;
+    Generate(board, GEN_CAPTURES, ALL);
 
     return m_moves;
 }
 
-MoveList MoveGenerator::GenerateCaptures(Board &board) {
-    Init(board);
-    m_moves.reserve(MAX_CAPTURES_RESERVE);
-    m_generateQuiet = false;
+MoveList& MoveGenerator::GenerateStaged(Board &board, GEN_TYPE genType, Bitboard fromMask) {
+    Generate(board, genType, fromMask);
 
-    //Calculations
-    m_kingDangerSquares = GenerateKingDangerAttacks(board);
-    m_pinned = PinnedPieces(board, m_color);
+    return m_moves;
+}
 
-    //Don't allow king moves to empty squares
-    m_kingDangerSquares |= ~m_allPieces;
+void MoveGenerator::Generate(Board &board, GEN_TYPE genType, Bitboard fromMask) {
+    if(!m_initialized) {
+        Init(board);
 
-    GeneratePseudoMoves(board);
+        //Calculations
+        m_kingDangerSquares = GenerateKingDangerAttacks(board);
+        m_pinned = PinnedPieces(board, m_color);
+        m_initialized = true;
+    }
+    m_moves.clear();
+    m_generateQuiet = genType != GEN_CAPTURES;
+    m_generateCaptures = genType != GEN_QUIETS;
+    m_fromMask = fromMask;
 
-    return m_moves;
+    if(board.IsCheck()) {
+        GenerateEvasionMoves(board);
+    } else {
+        GeneratePseudoMoves(board);
+    }
 }
 
 void MoveGenerator::Init(const Board& board) {
@@ -132,7 +135,7 @@ void MoveGenerator::GeneratePawnMoves(Board &board) {
 
     PIECE_TYPE piece = PAWN;
 
-    Bitboard thePawns = board.GetPieces(m_color, piece);
+    Bitboard thePawns = board.GetPieces(m_color, piece) & m_fromMask;
 
     Bitboard singlePush = RNorth(thePawns) & ~m_allPieces;
     Bitboard doublePush = RNorth(singlePush & MaskRank[relativeRank3]) & ~m_allPieces & m_pushMask;
@@ -153,6 +156,10 @@ void MoveGenerator::GeneratePawnMoves(Board &board) {
 
     singlePush *= m_generateQuiet;
     doublePush *= m_generateQuiet;
+    for(ATTACK_SIDE side : {LEFT, RIGHT}) {
+        attack[side] *= m_generateCaptures;
+        enpassant[side] *= m_generateCaptures;
+    }
 
     while(singlePush) {
         int toSq = ResetLsb(singlePush);
@@ -224,7 +231,7 @@ void MoveGenerator::GeneratePawnMoves(Board &board) {
 void MoveGenerator::GenerateKnightMoves(Board &board) {
     PIECE_TYPE piece = KNIGHT;
     Bitboard theKnights = board.GetPieces(m_color, piece);
-    theKnights &= ~m_pinned;
+    theKnights &= ~m_pinned & m_fromMask;
 
     while(theKnights) {
         int square = ResetLsb(theKnights);
@@ -239,6 +246,8 @@ void MoveGenerator::GenerateKingMoves(Board &board) {
 
     //Exit if no king on the board
     assert(theKing);
+    if(!(theKing & m_fromMask))
+        return;
 
     //Attacks
     int square = BitscanForward(theKing);
@@ -255,7 +264,7 @@ void MoveGenerator::GenerateKingMoves(Board &board) {
         AddCastlingMoves(board);
 }
 void MoveGenerator::GenerateSlidingMoves(PIECE_TYPE pieceType, Board &board) {
-    Bitboard thePieces = board.GetPieces(m_color, pieceType);
+    Bitboard thePieces = board.GetPieces(m_color, pieceType) & m_fromMask;
 
     while(thePieces) {
         //Attacks
@@ -275,6 +284,7 @@ void MoveGenerator::AddMoves(Board &board, PIECE_TYPE piece, int fromSq, Bitboar
     if(piece != KING) {
         captureMoves &= m_captureMask;
     }
+    captureMoves *= m_generateCaptures;
 
     while(captureMoves) {
         int toSq = ResetLsb(captureMoves);
@@ -319,8 +329,10 @@ void MoveGenerator::AddPromotionMoves(Board &board, int fromSq, Bitboard promoti
             move = Move(fromSq, toSq, PIECE_TYPE::PAWN, MOVE_TYPE::PROMOTION);
         }
 
-        move.SetPromotionFlag(PROMOTION_QUEEN);
-        m_moves.push_back(move);
+        if(m_generateCaptures) {
+            move.SetPromotionFlag(PROMOTION_QUEEN);
+            m_moves.push_back(move);
+        }
 
         if(m_generateQuiet) {
             for(int p = PROMOTION_KNIGHT; p <= PROMOTION_BISHOP; p++) {
@@ -1,10 +1,13 @@
 #include "MoveMaker.h"
 #include "Board.h"
+#include "Hash.h"
 #include "NNUE.h"
 #include "Uci.h"
 
 #include <cstring> //for memcpy, delete this
 
+const PIECE_TYPE PROMOTED_PIECE[4] = { QUEEN, KNIGHT, ROOK, BISHOP }; //[PROMOTION_TYPE]
+
 void MoveMaker::MakeMove(Board& board, Move move, bool update_nnue) {
     // Get move information
     COLOR color = board.ActivePlayer();
@@ -13,10 +16,6 @@ void MoveMaker::MakeMove(Board& board, Move move, bool update_nnue) {
     PIECE_TYPE pieceType = move.PieceType();
     MOVE_TYPE moveType = move.MoveType();
 
-    //Before any change in the board state
-    if(update_nnue && !UCI_CLASSICAL_EVAL)
-        nnue.SavePosition(board.m_ply);
-
     //Increase ply
     ++board.m_ply;
     if(color == BLACK) {
@@ -71,6 +70,11 @@ void MoveMaker::MakeMove(Board& board, Move move, bool update_nnue) {
     board.m_activePlayer = board.InactivePlayer();
     board.m_zobristKey.UpdateColor();
 
+    //The new keys are final: start loading the hash entries while the rest of the board is updated
+    Hash::tt.Prefetch(board.ZKey());
+    if(UCI_CLASSICAL_EVAL && Hash::pawnHash && (pieceType == PAWN || move.CapturedType() == PAWN))
+        Hash::pawnHash->Prefetch(board.PawnKey());
+
     //Store irreversible information (to help a later TakeMove)
     assert(board.m_ply >= 0 && board.m_ply <= MAX_PLY);
     board.m_history[board.m_ply].fiftyrule = board.m_fiftyrule;
@@ -85,16 +89,36 @@ void MoveMaker::MakeMove(Board& board, Move move, bool update_nnue) {
     //Reset check calculation
     board.m_checkCalculated = false;
 
-    //NNUE update
+    //NNUE update (deferred until the position is evaluated)
     if(update_nnue && !UCI_CLASSICAL_EVAL) {
-        if(pieceType != KING && (moveType == NORMAL || moveType == DOUBLE_PUSH || moveType == CAPTURE)) { //Incremental update
+        NNUE& nnue = board.m_nnue;
+        nnue.NewPosition(board.m_ply);
+        if(pieceType == KING) { //Only the perspective of the king is refreshed
+            nnue.Inputs_Refresh(color);
+
+            if(moveType == CAPTURE) {
+                nnue.Inputs_RemovePiece((1-color), (move.CapturedType()-1), toSq);
+            } else if(moveType == CASTLING) {
+                const int rookFromSq = toSq > fromSq ? fromSq + 3 : fromSq - 4;
+                const int rookToSq = (fromSq + toSq) / 2;
+                nnue.Inputs_MovePiece(color, (ROOK-1), rookFromSq, rookToSq);
+            }
+        } else if(moveType == PROMOTION || moveType == PROMOTION_CAPTURE) { //Incremental update: 1 add, 1-2 sub
+            nnue.Inputs_RemovePiece(color, (PAWN-1), fromSq);
+            nnue.Inputs_AddPiece(color, (PROMOTED_PIECE[move.PromotionType()]-1), toSq);
+
+            if(moveType == PROMOTION_CAPTURE) {
+                nnue.Inputs_RemovePiece((1-color), (move.CapturedType()-1), toSq);
+            }
+        } else { //Incremental update: 1 add, 1-2 sub
             nnue.Inputs_MovePiece(color, (pieceType-1), fromSq, toSq);
 
             if(moveType == CAPTURE) {
                 nnue.Inputs_RemovePiece((1-color), (move.CapturedType()-1), toSq);
+            } else if(moveType == ENPASSANT) {
+                const int squareShift = color == WHITE ? -8 : 8;
+                nnue.Inputs_RemovePiece((1-color), (PAWN-1), toSq + squareShift);
             }
-        } else {
-            nnue.Inputs_FullUpdate();
         }
     }
 
@@ -172,7 +196,7 @@ void MoveMaker::TakeMove(Board& board, Move move) {
 
     //Retrieve NNUE
     if(!UCI_CLASSICAL_EVAL)
-        nnue.RestorePosition(board.m_ply);
+        board.m_nnue.RestorePosition(board.m_ply);
 
     //Asserts
     assert(board.CheckIntegrity());
@@ -201,6 +225,7 @@ void MoveMaker::MakeNull(Board& board) {
     //Change the active player
     board.m_activePlayer = board.InactivePlayer();
     board.m_zobristKey.UpdateColor();
+    Hash::tt.Prefetch(board.ZKey());
 
     //Store irreversible information (to help a later TakeMove)
     board.m_history[board.m_ply].fiftyrule = board.m_fiftyrule;
@@ -212,6 +237,10 @@ void MoveMaker::MakeNull(Board& board) {
     //Reset check calculation
     board.m_checkCalculated = false;
 
+    //NNUE: same pieces, no changes
+    if(!UCI_CLASSICAL_EVAL)
+        board.m_nnue.NewPosition(board.m_ply);
+
     //Asserts
     assert(move.MoveType() == NULLMOVE);
 }
@@ -231,6 +260,10 @@ void MoveMaker::TakeNull(Board& board) {
 
     //Reset check calculation
     board.m_checkCalculated = false;
+
+    //Retrieve NNUE
+    if(!UCI_CLASSICAL_EVAL)
+        board.m_nnue.RestorePosition(board.m_ply);
 }
 
 void MoveMaker::AddPiece(Board& board, int square, COLOR color, PIECE_TYPE pieceType) {
@@ -0,0 +1,168 @@
+#include "MovePicker.h"
+#include "Board.h"
+#include "Heuristics.h"
+
+#include <algorithm>
+
+const int SCORE_HASH = 255;
+const int SCORE_SEE_ZERO = 240; //captures below are searched after the quiet moves
+
+MovePicker::MovePicker(Board &board, u16 hashMove, const Heuristics &heuristics, int ply)
+    : m_board(board), m_heuristics(heuristics), m_ply(ply)
+{
+    m_hashMove = hashMove;
+    m_moves = nullptr;
+    m_index = 0;
+    m_badIndex = 0;
+    m_numKillers = 0;
+    m_killerIndex = 0;
+
+    //Evasions: generate and sort everything now (few moves, and the count is needed)
+    if(board.IsCheck()) {
+        m_moves = &m_gen.GenerateStaged(board, GEN_ALL);
+        Sorting::SortMoves(board, *m_moves, hashMove, heuristics, ply);
+        m_stage = STAGE_EVASIONS;
+        return;
+    }
+
+    //Killer candidates: 194-191, validated later in their stage
+    Move killers[4] = { heuristics.killer.Primary(ply), heuristics.killer.Secondary(ply) };
+    if(ply >= 2) {
+        killers[2] = heuristics.killer.Primary(ply-2);
+        killers[3] = heuristics.killer.Secondary(ply-2);
+    }
+    for(int i = 0; i < 4; i++) {
+        Move killer = killers[i];
+        if(killer.MoveType() == NULLMOVE || killer.Compact() == hashMove || IsKiller(killer))
+            continue;
+        killer.SetScore(194 - i);
+        m_killers[m_numKillers++] = killer;
+    }
+
+    m_stage = hashMove ? STAGE_HASH : STAGE_GEN_CAPTURES;
+}
+
+Move MovePicker::NextMove() {
+    switch(m_stage) {
+        case STAGE_HASH: {
+            m_stage = STAGE_GEN_CAPTURES;
+
+            //Only the moves of the piece on the 'from' square are generated to validate the hash move
+            Bitboard fromMask = SquareBB(m_hashMove & 0x3F);
+            for(Move move : m_gen.GenerateStaged(m_board, GEN_ALL, fromMask)) {
+                if(move.Compact() == m_hashMove) {
+                    move.SetScore(SCORE_HASH);
+                    return move;
+                }
+            }
+            m_hashMove = 0; //not legal in this position (key collision)
+        }
+        [[fallthrough]];
+
+        case STAGE_GEN_CAPTURES: {
+            m_moves = &m_gen.GenerateStaged(m_board, GEN_CAPTURES);
+            m_index = 0;
+
+            //Preliminary ordering by MVV-LVA. SEE is calculated when the capture is picked
+            for(auto &move : *m_moves) {
+                int captured = move.MoveType() == ENPASSANT ? PAWN : move.CapturedType();
+                move.SetScore(64 * move.IsPromotion() + 8 * captured + (KING - move.PieceType()));
+            }
+            m_stage = STAGE_GOOD_CAPTURES;
+        }
+        [[fallthrough]];
+
+        case STAGE_GOOD_CAPTURES: {
+            while(m_index < m_moves->size()) {
+                Move move = PickBestCapture();
+                if(move.Compact() == m_hashMove)
+                    continue;
+
+                move.SetScore(Sorting::CaptureScore(m_board, move));
+                if(move.Score() < SCORE_SEE_ZERO) {
+                    m_badCaptures.push_back(move);
+                    continue;
+                }
+                return move;
+            }
+            m_stage = STAGE_KILLERS;
+        }
+        [[fallthrough]];
+
+        case STAGE_KILLERS: {
+            while(m_killerIndex < m_numKillers) {
+                Move killer = m_killers[m_killerIndex++];
+
+                //A killer is a quiet move from another position: legal here?
+                for(Move move : m_gen.GenerateStaged(m_board, GEN_QUIETS, SquareBB(killer.FromSq()))) {
+                    if(move == killer)
+                        return killer;
+                }
+            }
+            m_stage = STAGE_GEN_QUIETS;
+        }
+        [[fallthrough]];
+
+        case STAGE_GEN_QUIETS: {
+            m_moves = &m_gen.GenerateStaged(m_board, GEN_QUIETS);
+            m_index = 0;
+
+            COLOR color = m_board.ActivePlayer();
+            for(auto &move : *m_moves) {
+                move.SetScore(move.IsUnderpromotion() ? 0
+                                                      : Sorting::QuietScore(move, color, m_heuristics));
+            }
+            std::sort(m_moves->begin(), m_moves->end(), [](const Move &lmove, const Move &rmove) {
+                return lmove.Score() > rmove.Score();
+            });
+            m_stage = STAGE_QUIETS;
+        }
+        [[fallthrough]];
+
+        case STAGE_QUIETS: {
+            while(m_index < m_moves->size()) {
+                Move move = (*m_moves)[m_index++];
+                if(move.Compact() == m_hashMove || IsKiller(move))
+                    continue;
+                return move;
+            }
+            m_stage = STAGE_BAD_CAPTURES;
+        }
+        [[fallthrough]];
+
+        case STAGE_BAD_CAPTURES: {
+            if(m_badIndex < m_badCaptures.size())
+                return m_badCaptures[m_badIndex++];
+            m_stage = STAGE_DONE;
+            return Move();
+        }
+
+        case STAGE_EVASIONS: {
+            if(m_index < m_moves->size())
+                return (*m_moves)[m_index++];
+            m_stage = STAGE_DONE;
+            return Move();
+        }
+
+        case STAGE_DONE:
+        default:
+            return Move();
+    }
+}
+
+//Selection of the best remaining capture: cut-offs usually happen before the list is sorted
+Move MovePicker::PickBestCapture() {
+    auto best = std::max_element(m_moves->begin() + m_index, m_moves->end(), [](const Move &lmove, const Move &rmove) {
+        return lmove.Score() < rmove.Score();
+    });
+    std::iter_swap(m_moves->begin() + m_index, best);
+    return (*m_moves)[m_index++];
+}
+
+bool MovePicker::IsKiller(Move move) const {
+    for(int i = 0; i < m_numKillers; i++) {
+        if(m_killers[i] == move)
+            return true;
+    }
+    return false;
+}
@@ -1,9 +1,23 @@
 #include "NNUE.h"
 #include "BitboardUtils.h"
-#include <immintrin.h>
+#include "Board.h"
+#include "NNUEKernels.h"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cctype>
 #include <cstring>
 #include <fstream>
+#include <thread>
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 const u8 KING_BUCKETS[64] = {
 	 0, 1, 2, 3, 4, 5, 6, 7,
@@ -16,250 +30,670 @@ const u8 KING_BUCKETS[64] = {
 	28,28,29,29,30,30,31,31
 };
 
-NNUE::NNUE() {
-    m_isLoaded = false;
-    m_filepath = "network-20220625.nnue";
+//Quantized from a float file, or set
+namespace NNUENetwork {
+    Network network;
+    const Network* weights = &network;
+}
+
+//Private functions
+namespace {
+    //Rounded and clamped to [min, max], counting the saturated values
+    template<typename T>
+    T Quantize(float value, float scale, long min, long max, int &saturated) {
+        long quantized = std::lround(value * scale);
+        if(quantized < min || quantized > max) {
+            saturated++;
+            quantized = std::clamp(quantized, min, max);
+        }
+        return (T)quantized;
+    }
 
-    for(int i = 0; i < NNUE_SIZE; i++) {
-        m_accumulator[0][i] = 0;
-        m_accumulator[1][i] = 0;
+    //The float weights are by rows, [output][input]
+    template<size_t WEIGHTS, size_t BIASES>
+    void QuantizeLayer(const float (&weights)[WEIGHTS], const float (&biases)[BIASES], i8* qWeights, int* qBiases, int &saturated, bool sparse = false) {
+        const size_t dimInput = WEIGHTS / BIASES;
+        for(size_t i = 0; i < WEIGHTS; i++) {
+            const size_t index = sparse ? SparseWeightIndex(i % dimInput, i / dimInput, BIASES) : i;
+            qWeights[index] = Quantize<i8>(weights[i], WEIGHT_SCALE, -127, 127, saturated); //-128 could saturate maddubs
+        }
+        for(size_t i = 0; i < BIASES; i++) {
+            qBiases[i] = Quantize<int>(biases[i], ACTIVATION_ONE * WEIGHT_SCALE, INT32_MIN, INT32_MAX, saturated);
+        }
     }
+
+    bool networkLoaded = false;
+    std::string networkPath = "network-20220625.nnue";
+
+    NetworkHeader EngineHeader() {
+        NetworkHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, NETWORK_MAGIC, sizeof(header.magic));
+        header.version = NETWORK_VERSION;
+        header.features = NNUE_FEATURES;
+        header.hidden = NNUE_SIZE;
+        header.layer2 = ARCH[L2][COL];
+        header.layer3 = ARCH[L3][COL];
+        header.accumulatorShift = ACCUMULATOR_SHIFT;
+        header.weightShift = WEIGHT_SHIFT;
+        header.size = sizeof(Network);
+        return header;
+    }
+
+    bool SameFormat(const NetworkHeader& lhs, const NetworkHeader& rhs) {
+        return std::memcmp(lhs.magic, rhs.magic, sizeof(lhs.magic)) == 0
+            && lhs.version == rhs.version
+            && lhs.features == rhs.features
+            && lhs.hidden == rhs.hidden
+            && lhs.layer2 == rhs.layer2
+            && lhs.layer3 == rhs.layer3
+            && lhs.accumulatorShift == rhs.accumulatorShift
+            && lhs.weightShift == rhs.weightShift
+            && lhs.size == rhs.size;
+    }
+
+    std::string ArchitectureName(const NetworkHeader& header) {
+        return std::to_string(header.features) + "x" + std::to_string(header.hidden) + "x"
+             + std::to_string(header.layer2) + "x" + std::to_string(header.layer3) + "x1";
+    }
+
+    //Read-only mapping of a whole file, shared with the page cache. nullptr on failure
+    struct Mapping {
+        const u8* data = nullptr;
+        u64 bytes = 0;
+#ifdef _MSC_VER
+        HANDLE handle = nullptr;
+#endif
+    };
+    Mapping mapping;
+
+    Mapping MapFile(const std::string& filepath) {
+        Mapping result;
+#ifdef _MSC_VER
+        HANDLE file = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+            return result;
+        LARGE_INTEGER size;
+        HANDLE handle = GetFileSizeEx(file, &size) ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+        CloseHandle(file);
+        if(!handle)
+            return result;
+        void* data = MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+        if(!data) {
+            CloseHandle(handle);
+            return result;
+        }
+        result.data = (const u8*)data;
+        result.bytes = size.QuadPart;
+        result.handle = handle;
+#else
+        int fd = open(filepath.c_str(), O_RDONLY);
+        if(fd < 0)
+            return result;
+        struct stat st;
+        void* data = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(data == MAP_FAILED)
+            return result;
+    #ifdef MADV_WILLNEED
+        madvise(data, st.st_size, MADV_WILLNEED); //only a hint: ignore failures
+    #endif
+        result.data = (const u8*)data;
+        result.bytes = st.st_size;
+#endif
+        return result;
+    }
+
+    void UnmapFile(Mapping& map) {
+        if(!map.data)
+            return;
+#ifdef _MSC_VER
+        UnmapViewOfFile(map.data);
+        CloseHandle(map.handle);
+#else
+        munmap((void*)map.data, map.bytes);
+#endif
+        map = Mapping();
+    }
+
+    //A header and a Network of this engine
+    bool IsValidNetwork(const u8* data, u64 bytes, const std::string& filepath) {
+        const NetworkHeader* header = (const NetworkHeader*)data;
+        if(bytes == sizeof(NetworkHeader) + sizeof(Network) && SameFormat(*header, EngineHeader()))
+            return true;
+
+        std::cout << "ERROR: NNUE file of another version or architecture: " << filepath;
+        if(bytes >= sizeof(NetworkHeader)) {
+            std::cout << " (version " << header->version << " " << ArchitectureName(*header)
+                      << ", engine version " << NETWORK_VERSION << " " << ArchitectureName(EngineHeader()) << ")";
+        }
+        std::cout << std::endl;
+        return false;
+    }
+
+    //Quantized format: the weights are used from the mapping. False if the file is not valid
+    bool MapNetwork(const std::string& filepath) {
+        Mapping newMapping = MapFile(filepath);
+        if(!newMapping.data)
+            return false;
+
+        if(!IsValidNetwork(newMapping.data, newMapping.bytes, filepath)) {
+            UnmapFile(newMapping);
+            return false;
+        }
+
+        //The previous network is released once it is no longer in use
+        NNUENetwork::weights = (const Network*)(newMapping.data + sizeof(NetworkHeader));
+        UnmapFile(mapping);
+        mapping = newMapping;
+        return true;
+    }
+
+    //The network linked into the binary, used in place as a mapping. False if there is none
+    bool UseEmbeddedNetwork() {
+        const u8* data = NNUENetwork::EmbeddedData();
+        if(!data || !IsValidNetwork(data, NNUENetwork::EmbeddedSize(), EMBEDDED_NETWORK))
+            return false;
+
+        NNUENetwork::weights = (const Network*)(data + sizeof(NetworkHeader));
+        UnmapFile(mapping);
+        return true;
+    }
+
+    bool IsQuantizedFormat(std::ifstream& file) {
+        char magic[sizeof(NETWORK_MAGIC)] = {};
+        file.read(magic, sizeof(magic));
+        file.seekg(0);
+        return std::memcmp(magic, NETWORK_MAGIC, sizeof(magic)) == 0;
+    }
+
+    //Batch evaluation
+
+    //Features of the pieces [COLOR][PIECE_TYPE], from both perspectives
+    BatchPosition BatchInputs(const Bitboard (&pieces)[2][8], int color) {
+        BatchPosition position;
+        position.color = color;
+        for(int perspective = WHITE; perspective <= BLACK; perspective++) {
+            const int kingSquare = BitscanForward(pieces[perspective][KING]);
+            const int kingBucket = KING_BUCKETS[perspective == WHITE ? kingSquare : kingSquare ^ 56];
+
+            int numFeatures = 0;
+            for(int pieceColor = WHITE; pieceColor <= BLACK; pieceColor++) {
+                for(int pieceType = PAWN; pieceType <= QUEEN; pieceType++) {
+                    Bitboard bitboard = pieces[pieceColor][pieceType];
+                    while(bitboard) {
+                        int square = ResetLsb(bitboard);
+                        position.features[perspective][numFeatures++] = NNUE::Feature(perspective, kingBucket, pieceColor, pieceType-1, square);
+                    }
+                }
+            }
+            position.numFeatures = numFeatures;
+        }
+        return position;
+    }
+
+    //Rows of the block buffers in whole cache lines, as the kernels expect of their input
+    constexpr uint CacheLines(uint bytes) { return (bytes + 63) / 64 * 64; }
+
+    struct BatchBuffers {
+        alignas(64) i16 accumulator[NNUE_SIZE];
+        alignas(64) u8  o1[BATCH_BLOCK_SIZE][ CacheLines(ARCH[L2][ROW]) ];
+        alignas(64) int sum2[BATCH_BLOCK_SIZE][ ARCH[L2][COL] ];
+        alignas(64) u8  o2[BATCH_BLOCK_SIZE][ CacheLines(ARCH[L3][ROW]) ];
+        alignas(64) int sum3[BATCH_BLOCK_SIZE][ ARCH[L3][COL] ];
+        alignas(64) u8  o3[BATCH_BLOCK_SIZE][ CacheLines(ARCH[L4][ROW]) ];
+    };
+
+    //Layer 3 by columns for the batch kernels, as layer 2 is in the Network
+    struct alignas(64) BatchWeights {
+        i8 w3[ ARCH_DIMENSIONS[L3][W] ];
+
+        explicit BatchWeights(const Network& network) {
+            for(uint o = 0; o < ARCH[L3][COL]; o++) {
+                for(uint i = 0; i < ARCH[L3][ROW]; i++) {
+                    w3[SparseWeightIndex(i, o, ARCH[L3][COL])] = network.w3[o * ARCH[L3][ROW] + i];
+                }
+            }
+        }
+    };
+
+    void EvaluateBlock(const BatchPosition* positions, int count, int* scores, const BatchWeights& batchWeights) {
+        const NNUEKernels::Kernels& kernels = NNUEKernels::kernels;
+        const Network& network = *NNUENetwork::weights;
+        BatchBuffers buffers;
+
+        //Layer 1: biases + the weights of the active features, the active player first
+        for(int p = 0; p < count; p++) {
+            const BatchPosition& position = positions[p];
+            for(int side = 0; side < 2; side++) {
+                const int perspective = side == 0 ? position.color : 1 - position.color;
+                kernels.UpdateAccumulator(network.b1, buffers.accumulator, position.features[perspective], position.numFeatures, nullptr, 0);
+                kernels.ActivateAccumulator(buffers.accumulator, &buffers.o1[p][side * NNUE_SIZE]);
+            }
+        }
+        //The kernels of layers 2 and 3 compute a whole block: the rows of a last, partial block are zero
+        std::memset(buffers.o1[count], 0, (BATCH_BLOCK_SIZE - count) * sizeof(buffers.o1[0]));
+
+        //Layers 2 and 3: matrix-matrix products of the block, layer 4 a dot product per position
+        kernels.ComputeLayerBatch[L2](buffers.o1[0], sizeof(buffers.o1[0]), buffers.sum2[0], network.b2, network.w2);
+        for(int p = 0; p < BATCH_BLOCK_SIZE; p++) {
+            NNUE::ActivateLayer<ARCH[L2][COL]>(buffers.sum2[p], buffers.o2[p]);
+        }
+        kernels.ComputeLayerBatch[L3](buffers.o2[0], sizeof(buffers.o2[0]), buffers.sum3[0], network.b3, batchWeights.w3);
+        for(int p = 0; p < count; p++) {
+            int o4[1];
+            NNUE::ActivateLayer<ARCH[L3][COL]>(buffers.sum3[p], buffers.o3[p]);
+            kernels.ComputeLayer[L4](buffers.o3[p], o4, network.b4, network.w4);
+            scores[p] = o4[0] * 100 / (ACTIVATION_ONE * WEIGHT_SCALE);
+        }
+    }
+}
+
+int QuantizeNetwork(const NetworkStorage& storage, Network& network) {
+    int saturated = 0;
+
+    //Layer 1: from CONVERSION_FACTOR to ACCUMULATOR_SCALE units
+    for(size_t i = 0; i < (sizeof(storage.w1) / sizeof(storage.w1[0])); i++) {
+        network.w1[i] = (i16)((storage.w1[i] + (1 << (ACCUMULATOR_SHIFT - 1))) >> ACCUMULATOR_SHIFT);
+    }
+    for(size_t i = 0; i < (sizeof(storage.b1) / sizeof(storage.b1[0])); i++) {
+        network.b1[i] = Quantize<i16>(storage.b1[i], ACCUMULATOR_SCALE, INT16_MIN, INT16_MAX, saturated);
+    }
+
+    //Layers 2,3,4
+    QuantizeLayer(storage.w2, storage.b2, network.w2, network.b2, saturated, true);
+    QuantizeLayer(storage.w3, storage.b3, network.w3, network.b3, saturated);
+    QuantizeLayer(storage.w4, storage.b4, network.w4, network.b4, saturated);
+
+    return saturated;
 }
 
-void NNUE::Load(std::string filepath) {
-    if(!filepath.empty()) {
-        m_filepath = filepath;
+void NNUENetwork::Load(std::string filepath) {
+    if((filepath.empty() || filepath == EMBEDDED_NETWORK) && UseEmbeddedNetwork()) {
+        networkPath = EMBEDDED_NETWORK;
+        std::cout << "NNUE loaded (embedded)" << std::endl;
+        networkLoaded = true;
+        return;
     }
 
+    //The path is kept only once the network is loaded: a rejected file leaves the previous one reported
+    const std::string path = filepath.empty() ? networkPath : filepath;
+
     std::ifstream file;
-    file.open(m_filepath.c_str(), std::ios::binary);
+    file.open(path.c_str(), std::ios::binary);
 
     if(!file.is_open()) {
-        std::cout << "ERROR: NNUE file not found: " << m_filepath << std::endl;
+        std::cout << "ERROR: NNUE file not found: " << path << std::endl;
+        return;
+    }
+
+    if(IsQuantizedFormat(file)) {
+        file.close();
+        if(MapNetwork(path)) {
+            networkPath = path;
+            std::cout << "NNUE loaded (mapped): " << networkPath << std::endl;
+            networkLoaded = true;
+        }
         return;
     }
 
     NetworkStorage* nnue_storage = new NetworkStorage;
     file.read((char*)nnue_storage, sizeof(NetworkStorage));
 
-    for(size_t i = 0; i < (sizeof(nnue_storage->w1) / sizeof(nnue_storage->w1[0])); i++) {
-        m_network.w1[i] = (float)nnue_storage->w1[i] / CONVERSION_FACTOR;
-    }
+    //The float format has no header: its size is that of the architecture
+    if(file.gcount() == sizeof(NetworkStorage) && file.peek() == EOF) {
+        QuantizeNetwork(*nnue_storage, network);
+        weights = &network;
+        UnmapFile(mapping);
+        networkPath = path;
 
-    size_t size = sizeof(nnue_storage->b1);
-    size += sizeof(nnue_storage->w2) + sizeof(nnue_storage->b2);
-    size += sizeof(nnue_storage->w3) + sizeof(nnue_storage->b3);
-    size += sizeof(nnue_storage->w4) + sizeof(nnue_storage->b4);
-    std::memcpy(m_network.b1, nnue_storage->b1, size);
-
-    if(file.gcount()) {
-        std::cout << "NNUE loaded: " << m_filepath << std::endl;
-        m_isLoaded = true;
+        std::cout << "NNUE loaded: " << networkPath << std::endl;
+        networkLoaded = true;
     } else {
-        std::cout << "ERROR: NNUE not loaded correctly from file: " << m_filepath << std::endl;
+        std::cout << "ERROR: NNUE not loaded correctly from file (another architecture?): " << path << std::endl;
     }
 
     delete nnue_storage;
     file.close();
 }
 
-#include "Utils.h"
-Utils::Clock clock_eval;
+bool NNUENetwork::Save(std::string filepath, const Network& network) {
+    std::ofstream file;
+    file.open(filepath.c_str(), std::ios::binary);
 
-int NNUE::Evaluate(int color) {
-    //Layer 1
-    float o1[ ARCH[L2][ROW] ];
-    for(uint i = 0; i < NNUE_SIZE; i++) {
-        o1[i            ] = Clamp(m_accumulator[color][i]);
-    }
-    for(uint i = 0; i < NNUE_SIZE; i++) {
-        o1[i + NNUE_SIZE] = Clamp(m_accumulator[1-color][i]);
+    if(!file.is_open()) {
+        std::cout << "ERROR: NNUE file not writable: " << filepath << std::endl;
+        return false;
     }
 
-    //Layers 2,3,4
-    float o2[ ARCH[L3][ROW] ];
-    float o3[ ARCH[L4][ROW] ];
-    float o4[1];
+    const NetworkHeader header = EngineHeader();
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)&network, sizeof(network));
+    return file.good();
+}
 
-    ComputeLayer(o1, o2, m_network.b2, m_network.w2, ARCH[L2][ROW], ARCH[L2][COL], true);
-    ComputeLayer(o2, o3, m_network.b3, m_network.w3, ARCH[L3][ROW], ARCH[L3][COL], true);
-    ComputeLayer(o3, o4, m_network.b4, m_network.w4, ARCH[L4][ROW], ARCH[L4][COL], false);
+void NNUENetwork::SetNetwork(const Network& newNetwork) {
+    network = newNetwork;
+    weights = &network;
+    UnmapFile(mapping);
+}
 
-    return o4[0] * 100;
+bool NNUENetwork::IsLoaded() {
+    return networkLoaded;
 }
 
-void NNUE::SavePosition(int ply) {
-    std::memcpy(&m_backupAccumulator[ply], &m_accumulator, sizeof(m_accumulator));
+bool NNUENetwork::IsMapped() {
+    return mapping.data != nullptr;
 }
 
-void NNUE::RestorePosition(int ply) {
-    std::memcpy(&m_accumulator, &m_backupAccumulator[ply], sizeof(m_backupAccumulator[ply]));
+std::string NNUENetwork::GetPath() {
+    return networkPath;
 }
 
-void NNUE::SetPieces(int color, uint64_t& pieces) {
-    m_pieces[color] = &pieces;
+NNUE::NNUE() {
+    m_rootPly = 0;
+    m_index = 0;
+    std::memset(&m_states[0], 0, sizeof(m_states[0]));
+    m_states[0].computed[WHITE] = m_states[0].computed[BLACK] = true; //zeros until a board is bound
 }
 
-void NNUE::Inputs_FullUpdate() {
-    for(int i=0; i < NNUE_SIZE; i++) {
-        m_accumulator[0][i] = m_network.b1[i];
-        m_accumulator[1][i] = m_network.b1[i];
-    }
+//The position of the copy becomes its root
+NNUE::NNUE(const NNUE& other) {
+    Reset(other.m_rootPly + other.m_index);
+}
 
-    for(int color = WHITE; color <= BLACK; color++) {
-        for(int pieceType = PAWN; pieceType <= QUEEN; pieceType++) {
-            Bitboard bitboard = m_pieces[color][pieceType];
-            while(bitboard) {
-                int square = ResetLsb(bitboard);
-                Inputs_AddPiece(color, pieceType-1, square);
-            }
-        }
+NNUE& NNUE::operator=(const NNUE& other) {
+    if(this != &other) {
+        Reset(other.m_rootPly + other.m_index);
     }
+    return *this;
 }
 
-void NNUE::Inputs_AddPiece(int color, int pieceType, int square) {
-    const int kingSquare_w = BitscanForward(m_pieces[WHITE][KING]);
-    const int kingSquare_b = BitscanForward(m_pieces[BLACK][KING]) ^ 56;
-
-    const int kingBucket_w = KING_BUCKETS[kingSquare_w];
-    const int kingBucket_b = KING_BUCKETS[kingSquare_b];
-
-    const int index_w = (pieceType * 2) + (color);
-	const int index_b = (pieceType * 2) + (1 - color);
+#include "Utils.h"
+Utils::Clock clock_eval;
 
-    const int square_w = square;
-	const int square_b = square ^ 56;
+int NNUE::Evaluate(const Board& board) {
+    ComputeAccumulator(board);
+    const int color = board.ActivePlayer();
+    const AccumulatorState& state = m_states[m_index];
 
-    const int feature_w = (640 * kingBucket_w) + (64 * index_w) + (square_w);
-	const int feature_b = (640 * kingBucket_b) + (64 * index_b) + (square_b);
+    //Layer 1
+    const NNUEKernels::Kernels& kernels = NNUEKernels::kernels;
+    alignas(64) u8 o1[ ARCH[L2][ROW] ];
+    kernels.ActivateAccumulator(state.accumulator[color],   &o1[0]);
+    kernels.ActivateAccumulator(state.accumulator[1-color], &o1[NNUE_SIZE]);
 
-    assert(feature_w <= NNUE_FEATURES);
-    assert(feature_b <= NNUE_FEATURES);
+    //Layers 2,3,4
+    const Network& network = *NNUENetwork::weights;
+    alignas(64) int sum2[ ARCH[L2][COL] ];
+    alignas(64) u8  o2[ ARCH[L3][ROW] ];
+    alignas(64) int sum3[ ARCH[L3][COL] ];
+    alignas(64) u8  o3[ ARCH[L4][ROW] ];
+    int o4[1];
+
+    kernels.ComputeLayer[L2](o1, sum2, network.b2, network.w2);
+    ActivateLayer<ARCH[L2][COL]>(sum2, o2);
+    kernels.ComputeLayer[L3](o2, sum3, network.b3, network.w3);
+    ActivateLayer<ARCH[L3][COL]>(sum3, o3);
+    kernels.ComputeLayer[L4](o3, o4, network.b4, network.w4);
+
+    return o4[0] * 100 / (ACTIVATION_ONE * WEIGHT_SCALE);
+}
 
-    for(int i = 0; i < NNUE_SIZE; i++) {
-        m_accumulator[0][i] += m_network.w1[NNUE_SIZE * feature_w + i];
-        m_accumulator[1][i] += m_network.w1[NNUE_SIZE * feature_b + i];
+void NNUE::Reset(int ply) {
+    m_rootPly = ply;
+    m_index = 0;
+
+    AccumulatorState& state = m_states[m_index];
+    state.computed[WHITE] = state.computed[BLACK] = false;
+    state.refresh[WHITE] = state.refresh[BLACK] = true;
+    state.numDirty = 0;
+
+    //The network could have changed
+    for(int perspective = WHITE; perspective <= BLACK; perspective++) {
+        for(int bucket = 0; bucket < KING_BUCKETS_COUNT; bucket++) {
+            RefreshEntry& entry = m_refreshTable[perspective][bucket];
+            std::memcpy(entry.accumulator, NNUENetwork::weights->b1, sizeof(entry.accumulator));
+            std::memset(entry.pieces, 0, sizeof(entry.pieces));
+        }
     }
 }
 
-void NNUE::Inputs_RemovePiece(int color, int pieceType, int square) {
-    const int kingSquare_w = BitscanForward(m_pieces[WHITE][KING]);
-    const int kingSquare_b = BitscanForward(m_pieces[BLACK][KING]) ^ 56;
+void NNUE::NewPosition(int ply) {
+    m_index = ply - m_rootPly;
+    if(m_index < 0 || m_index >= ACCUMULATOR_STACK_SIZE) {
+        Reset(ply); //deeper than the stack: this position becomes the root
+        return;
+    }
 
-    const int kingBucket_w = KING_BUCKETS[kingSquare_w];
-    const int kingBucket_b = KING_BUCKETS[kingSquare_b];
+    AccumulatorState& state = m_states[m_index];
+    state.computed[WHITE] = state.computed[BLACK] = false;
+    state.refresh[WHITE] = state.refresh[BLACK] = false;
+    state.numDirty = 0;
+}
 
-    const int index_w = (pieceType * 2) + (color);
-	const int index_b = (pieceType * 2) + (1 - color);
+void NNUE::RestorePosition(int ply) {
+    m_index = ply - m_rootPly;
+    if(m_index < 0) {
+        Reset(ply); //back from a position that became the root
+    }
+}
 
-    const int square_w = square;
-	const int square_b = square ^ 56;
+void NNUE::Inputs_FullUpdate() {
+    Inputs_Refresh(WHITE);
+    Inputs_Refresh(BLACK);
+}
 
-    const int feature_w = (640 * kingBucket_w) + (64 * index_w) + (square_w);
-	const int feature_b = (640 * kingBucket_b) + (64 * index_b) + (square_b);
+void NNUE::Inputs_Refresh(int perspective) {
+    m_states[m_index].refresh[perspective] = true;
+}
 
-    assert(feature_w <= NNUE_FEATURES);
-    assert(feature_b <= NNUE_FEATURES);
+void NNUE::Inputs_AddPiece(int color, int pieceType, int square) {
+    AddDirtyPiece(color, pieceType, NO_SQUARE, square);
+}
 
-    for(int i = 0; i < NNUE_SIZE; i++) {
-        m_accumulator[0][i] -= m_network.w1[NNUE_SIZE * feature_w + i];
-        m_accumulator[1][i] -= m_network.w1[NNUE_SIZE * feature_b + i];
-    }
+void NNUE::Inputs_RemovePiece(int color, int pieceType, int square) {
+    AddDirtyPiece(color, pieceType, square, NO_SQUARE);
 }
 
 void NNUE::Inputs_MovePiece(int color, int pieceType, int fromSq, int toSq) {
-    const int kingSquare_w = BitscanForward(m_pieces[WHITE][KING]);
-    const int kingSquare_b = BitscanForward(m_pieces[BLACK][KING]) ^ 56;
-
-    const int kingBucket_w = KING_BUCKETS[kingSquare_w];
-    const int kingBucket_b = KING_BUCKETS[kingSquare_b];
-
-    const int index_w = (pieceType * 2) + (color);
-	const int index_b = (pieceType * 2) + (1 - color);
-
-    const int fromSq_w = fromSq;
-	const int fromSq_b = fromSq ^ 56;
+    AddDirtyPiece(color, pieceType, fromSq, toSq);
+}
 
-    const int toSq_w = toSq;
-	const int toSq_b = toSq ^ 56;
+void NNUE::AddDirtyPiece(int color, int pieceType, int fromSq, int toSq) {
+    AccumulatorState& state = m_states[m_index];
+    assert(!state.computed[WHITE] && !state.computed[BLACK] && state.numDirty < MAX_DIRTY_PIECES);
+    state.dirty[state.numDirty++] = { color, pieceType, fromSq, toSq };
+}
 
-    const int feature_from_w = (640 * kingBucket_w) + (64 * index_w) + (fromSq_w);
-	const int feature_from_b = (640 * kingBucket_b) + (64 * index_b) + (fromSq_b);
+//Applies the pending changes since the last computed position, or a refresh after a king move.
+//The root of the stack is always computed or marked for a refresh
+void NNUE::ComputeAccumulator(const Board& board) {
+    for(int perspective = WHITE; perspective <= BLACK; perspective++) {
+        int index = m_index;
+        while(!m_states[index].computed[perspective] && !m_states[index].refresh[perspective]) {
+            index--;
+            assert(index >= 0);
+        }
 
-    const int feature_to_w = (640 * kingBucket_w) + (64 * index_w) + (toSq_w);
-	const int feature_to_b = (640 * kingBucket_b) + (64 * index_b) + (toSq_b);
+        if(!m_states[index].computed[perspective]) {
+            RefreshAccumulator(board, m_states[m_index], perspective);
+            continue;
+        }
 
-    assert(feature_from_w <= NNUE_FEATURES);
-    assert(feature_from_b <= NNUE_FEATURES);
+        //The king square of this perspective is the same in all these positions
+        const int kingBucket = KingBucket(board, perspective);
+        for(index++; index <= m_index; index++) {
+            const AccumulatorState& previous = m_states[index-1];
+            AccumulatorState& state = m_states[index];
+
+            int added[MAX_DIRTY_PIECES], removed[MAX_DIRTY_PIECES];
+            int numAdded = 0, numRemoved = 0;
+            for(int i = 0; i < state.numDirty; i++) {
+                const DirtyPiece& piece = state.dirty[i];
+                if(piece.fromSq != NO_SQUARE)
+                    removed[numRemoved++] = Feature(perspective, kingBucket, piece.color, piece.pieceType, piece.fromSq);
+                if(piece.toSq != NO_SQUARE)
+                    added[numAdded++] = Feature(perspective, kingBucket, piece.color, piece.pieceType, piece.toSq);
+            }
+            NNUEKernels::kernels.UpdateAccumulator(previous.accumulator[perspective], state.accumulator[perspective], added, numAdded, removed, numRemoved);
+            state.computed[perspective] = true;
+        }
+    }
+}
 
-    assert(feature_to_w <= NNUE_FEATURES);
-    assert(feature_to_b <= NNUE_FEATURES);
+//Refresh from the last accumulator with the same king bucket: only the pieces that differ are updated
+void NNUE::RefreshAccumulator(const Board& board, AccumulatorState& state, int perspective) {
+    const int kingBucket = KingBucket(board, perspective);
+    RefreshEntry& entry = m_refreshTable[perspective][kingBucket];
 
-    for(int i = 0; i < NNUE_SIZE; i++) {
-        m_accumulator[0][i] -= m_network.w1[NNUE_SIZE * feature_from_w + i];
-        m_accumulator[1][i] -= m_network.w1[NNUE_SIZE * feature_from_b + i];
+    int added[32], removed[32];
+    int numAdded = 0, numRemoved = 0;
+    for(int color = WHITE; color <= BLACK; color++) {
+        for(int pieceType = PAWN; pieceType <= QUEEN; pieceType++) {
+            const Bitboard pieces = board.Piece((COLOR)color, (PIECE_TYPE)pieceType);
+            Bitboard &cached = entry.pieces[color][pieceType-1];
 
-        m_accumulator[0][i] += m_network.w1[NNUE_SIZE * feature_to_w + i];
-        m_accumulator[1][i] += m_network.w1[NNUE_SIZE * feature_to_b + i];
+            Bitboard bitboard = pieces & ~cached;
+            while(bitboard) {
+                int square = ResetLsb(bitboard);
+                added[numAdded++] = Feature(perspective, kingBucket, color, pieceType-1, square);
+            }
+            bitboard = cached & ~pieces;
+            while(bitboard) {
+                int square = ResetLsb(bitboard);
+                removed[numRemoved++] = Feature(perspective, kingBucket, color, pieceType-1, square);
+            }
+            cached = pieces;
+        }
     }
-}
 
-float NNUE::Clamp(float n) {
-    const float min = 0;
-    const float max = 1;
-    if(n < min) return min;
-    if(n > max) return max;
-    return n;
+    NNUEKernels::kernels.UpdateAccumulator(entry.accumulator, entry.accumulator, added, numAdded, removed, numRemoved);
+    std::memcpy(state.accumulator[perspective], entry.accumulator, sizeof(entry.accumulator));
+    state.computed[perspective] = true;
 }
 
-//Horizontal sum of 8 floats (256-bits)
-inline float HorizontalSum256(__m256 v) {
-    const __m128 r4 = _mm_add_ps( _mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1) );
-    const __m128 r2 = _mm_add_ps( r4, _mm_movehl_ps( r4, r4 ) );
-    const __m128 r1 = _mm_add_ss( r2, _mm_movehdup_ps( r2 ) );
-    return _mm_cvtss_f32(r1);
+int NNUE::KingBucket(const Board& board, int perspective) {
+    const int kingSquare = BitscanForward(board.Piece((COLOR)perspective, KING));
+    return KING_BUCKETS[perspective == WHITE ? kingSquare : kingSquare ^ 56];
 }
 
-void NNUE::ComputeLayer(float* inputLayer, float* outputLayer, float* biases, float* weights, int dimInput, int dimOutput, bool with_ReLU) {
-    for(int o = 0; o < dimOutput; o++) {
-        float sum = biases[o];
+//Index in the input layer of a piece (pieceType from 0), from the perspective of one side
+int NNUE::Feature(int perspective, int kingBucket, int color, int pieceType, int square) {
+    const int index = (pieceType * 2) + (perspective == WHITE ? color : 1 - color);
+    const int relativeSquare = perspective == WHITE ? square : square ^ 56;
 
-        const int offset = o * dimInput;
-
-        __m256 dot0 = _mm256_setzero_ps();
-        __m256 dot1 = _mm256_setzero_ps();
-        __m256 dot2 = _mm256_setzero_ps();
-        __m256 dot3 = _mm256_setzero_ps();
+    const int feature = (640 * kingBucket) + (64 * index) + relativeSquare;
+    assert(feature < NNUE_FEATURES);
+    return feature;
+}
 
-        //_mm512_setzero_ps
+//Clipped ReLU of a hidden layer to [0, ACTIVATION_ONE]
+template<int DIM>
+void NNUE::ActivateLayer(const int* input, u8* output) {
+    for(int i = 0; i < DIM; i++) {
+        int value = (input[i] + (WEIGHT_SCALE / 2)) >> WEIGHT_SHIFT;
+        output[i] = (u8)std::clamp(value, 0, ACTIVATION_ONE);
+    }
+}
 
-        for(int i = 0; i < dimInput; i += 32) {
-            __m256 inputs0 = _mm256_loadu_ps(&inputLayer[i +  0]);
-            __m256 inputs1 = _mm256_loadu_ps(&inputLayer[i +  8]);
-            __m256 inputs2 = _mm256_loadu_ps(&inputLayer[i + 16]);
-            __m256 inputs3 = _mm256_loadu_ps(&inputLayer[i + 24]);
+BatchPosition NNUEBatch::FromBoard(const Board& board) {
+    Bitboard pieces[2][8] = {};
+    for(int color = WHITE; color <= BLACK; color++) {
+        for(int pieceType = PAWN; pieceType <= KING; pieceType++) {
+            pieces[color][pieceType] = board.Piece((COLOR)color, (PIECE_TYPE)pieceType);
+        }
+    }
+    return BatchInputs(pieces, board.ActivePlayer());
+}
 
-            __m256 weights0 = _mm256_loadu_ps(&weights[offset + i +  0]);
-            __m256 weights1 = _mm256_loadu_ps(&weights[offset + i +  8]);
-            __m256 weights2 = _mm256_loadu_ps(&weights[offset + i + 16]);
-            __m256 weights3 = _mm256_loadu_ps(&weights[offset + i + 24]);
+//Only the pieces and the active player: the rest of the fen doesn't change the evaluation
+bool NNUEBatch::FromFen(const std::string& fen, BatchPosition& position) {
+    const std::string PIECE_CHARS = "pnbrqk";
+    Bitboard pieces[2][8] = {};
+    int rank = RANK8, file = FILEA;
+
+    size_t i = 0;
+    for(; i < fen.size() && fen[i] != ' '; i++) {
+        const char theChar = fen[i];
+        if(theChar == '/') {
+            rank--;
+            file = FILEA;
+        }
+        else if(theChar >= '1' && theChar <= '8') {
+            file += theChar - '0';
+        }
+        else {
+            const size_t index = PIECE_CHARS.find((char)std::tolower(theChar));
+            if(index == std::string::npos || rank < RANK1 || file > FILEH)
+                return false;
+            const int color = std::isupper(theChar) ? WHITE : BLACK;
+            pieces[color][PAWN + index] |= SquareBB(8 * rank + file);
+            file++;
+        }
+    }
+    if(i + 1 >= fen.size() || (fen[i + 1] != 'w' && fen[i + 1] != 'b'))
+        return false;
 
-            dot0 = _mm256_fmadd_ps(inputs0, weights0, dot0);
-            dot1 = _mm256_fmadd_ps(inputs1, weights1, dot1);
-            dot2 = _mm256_fmadd_ps(inputs2, weights2, dot2);
-            dot3 = _mm256_fmadd_ps(inputs3, weights3, dot3);
+    int numPieces = 0;
+    for(int color = WHITE; color <= BLACK; color++) {
+        if(PopCount(pieces[color][KING]) != 1)
+            return false;
+        for(int pieceType = PAWN; pieceType <= KING; pieceType++) {
+            numPieces += PopCount(pieces[color][pieceType]);
         }
-        
-        dot0 = _mm256_add_ps( dot0, dot1 );
-        dot2 = _mm256_add_ps( dot2, dot3 );
-        dot0 = _mm256_add_ps( dot0, dot2 );
+    }
+    if(numPieces > 32)
+        return false;
 
-        sum += HorizontalSum256(dot0);
+    position = BatchInputs(pieces, fen[i + 1] == 'w' ? WHITE : BLACK);
+    return true;
+}
 
-        if(with_ReLU) {
-            outputLayer[o] = Clamp(sum);
-        } else {
-            outputLayer[o] = sum;
+//Each thread takes a contiguous range of whole blocks
+std::vector<int> NNUEBatch::Evaluate(const std::vector<BatchPosition>& positions, int threads) {
+    const int size = positions.size();
+    std::vector<int> scores(size);
+    const BatchWeights batchWeights(*NNUENetwork::weights);
+
+    const int numBlocks = (size + BATCH_BLOCK_SIZE - 1) / BATCH_BLOCK_SIZE;
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1, std::min(threads, numBlocks));
+    const int blocksPerThread = (numBlocks + threads - 1) / threads;
+
+    auto EvaluateRange = [&](int firstBlock) {
+        const int first = firstBlock * BATCH_BLOCK_SIZE;
+        const int last = std::min(size, (firstBlock + blocksPerThread) * BATCH_BLOCK_SIZE);
+        for(int p = first; p < last; p += BATCH_BLOCK_SIZE) {
+            EvaluateBlock(&positions[p], std::min(BATCH_BLOCK_SIZE, last - p), &scores[p], batchWeights);
         }
+    };
+
+    std::vector<std::thread> workers;
+    for(int t = 1; t < threads; t++) {
+        workers.emplace_back(EvaluateRange, t * blocksPerThread);
+    }
+    EvaluateRange(0);
+    for(auto& worker : workers) {
+        worker.join();
+    }
+    return scores;
+}
+
+std::vector<int> NNUEBatch::Evaluate(const std::vector<std::string>& fens, int threads) {
+    std::vector<BatchPosition> positions(fens.size());
+    std::vector<bool> valid(fens.size());
+    for(size_t i = 0; i < fens.size(); i++) {
+        valid[i] = FromFen(fens[i], positions[i]);
+        if(!valid[i])
+            positions[i] = BatchPosition{}; //no features: evaluated and discarded
+    }
+
+    std::vector<int> scores = Evaluate(positions, threads);
+    for(size_t i = 0; i < fens.size(); i++) {
+        if(!valid[i])
+            scores[i] = 0;
     }
+    return scores;
 }
@@ -0,0 +1,751 @@
+#include "NNUEKernels.h"
+#include "NNUE.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define USE_X86_SIMD
+    #include <immintrin.h>
+#endif
+
+//The SIMD versions are compiled for their instruction set, whatever the flags of the build
+#if defined(__GNUC__)
+    #define TARGET(isa) __attribute__((target(isa)))
+#else
+    #define TARGET(isa)
+#endif
+
+namespace NNUEKernels {
+
+//Private functions
+namespace {
+
+    //Positions of the set bits of each 8-bit mask, and their count
+    struct NonZeroLookup {
+        u16 indices[256][8];
+        u8 count[256];
+
+        constexpr NonZeroLookup() : indices(), count() {
+            for(int mask = 0; mask < 256; mask++) {
+                for(int bit = 0; bit < 8; bit++) {
+                    if(mask & (1 << bit))
+                        indices[mask][count[mask]++] = bit;
+                }
+            }
+        }
+    };
+    constexpr NonZeroLookup NON_ZERO_LOOKUP;
+
+    //4 inputs of a sparse layer, as an int32
+    inline int InputBlock(const u8* input, int block) {
+        int value;
+        std::memcpy(&value, &input[4 * block], sizeof(value));
+        return value;
+    }
+
+    //Scalar
+    void UpdateAccumulator_Scalar(const i16* input, i16* output, const int* added, int numAdded, const int* removed, int numRemoved) {
+        if(output != input) {
+            std::memcpy(output, input, NNUE_SIZE * sizeof(i16));
+        }
+        //int16 arithmetic wraps around, as in the SIMD versions
+        for(int a = 0; a < numAdded; a++) {
+            const i16* weights = &NNUENetwork::weights->w1[NNUE_SIZE * added[a]];
+            for(int i = 0; i < NNUE_SIZE; i++) {
+                output[i] = (i16)(output[i] + weights[i]);
+            }
+        }
+        for(int r = 0; r < numRemoved; r++) {
+            const i16* weights = &NNUENetwork::weights->w1[NNUE_SIZE * removed[r]];
+            for(int i = 0; i < NNUE_SIZE; i++) {
+                output[i] = (i16)(output[i] - weights[i]);
+            }
+        }
+    }
+
+    //(accumulator * ACTIVATION_MULTIPLIER) >> 15 rounded, as mulhrs
+    void ActivateAccumulator_Scalar(const i16* accumulator, u8* output) {
+        for(int i = 0; i < NNUE_SIZE; i++) {
+            int value = (accumulator[i] * ACTIVATION_MULTIPLIER + (1 << 14)) >> 15;
+            output[i] = (u8)std::clamp(value, 0, ACTIVATION_ONE);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    void ComputeLayer_Scalar(const u8* input, int* output, const int* biases, const i8* weights) {
+        for(int o = 0; o < DIM_OUTPUT; o++) {
+            const int offset = o * DIM_INPUT;
+
+            int sum = biases[o];
+            for(int i = 0; i < DIM_INPUT; i++) {
+                sum += input[i] * weights[offset + i];
+            }
+            output[o] = sum;
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    void ComputeSparseLayer_Scalar(const u8* input, int* output, const int* biases, const i8* weights) {
+        std::memcpy(output, biases, DIM_OUTPUT * sizeof(int));
+        for(int block = 0; block < DIM_INPUT / 4; block++) {
+            if(!InputBlock(input, block))
+                continue;
+
+            const u8* inputs = &input[4 * block];
+            const i8* column = &weights[block * DIM_OUTPUT * 4];
+            for(int o = 0; o < DIM_OUTPUT; o++) {
+                output[o] += inputs[0] * column[4*o + 0] + inputs[1] * column[4*o + 1]
+                           + inputs[2] * column[4*o + 2] + inputs[3] * column[4*o + 3];
+            }
+        }
+    }
+
+    //The positions whose block of 4 inputs is zero are skipped
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    void ComputeLayerBatch_Scalar(const u8* input, int inputStride, int* output, const int* biases, const i8* weights) {
+        for(int p = 0; p < BATCH_BLOCK_SIZE; p++) {
+            std::memcpy(&output[p * DIM_OUTPUT], biases, DIM_OUTPUT * sizeof(int));
+        }
+        for(int block = 0; block < DIM_INPUT / 4; block++) {
+            const i8* column = &weights[block * DIM_OUTPUT * 4];
+            for(int p = 0; p < BATCH_BLOCK_SIZE; p++) {
+                const u8* inputs = &input[p * inputStride + 4 * block];
+                if(!InputBlock(inputs, 0))
+                    continue;
+
+                int* outputs = &output[p * DIM_OUTPUT];
+                for(int o = 0; o < DIM_OUTPUT; o++) {
+                    outputs[o] += inputs[0] * column[4*o + 0] + inputs[1] * column[4*o + 1]
+                                + inputs[2] * column[4*o + 2] + inputs[3] * column[4*o + 3];
+                }
+            }
+        }
+    }
+
+#if defined(USE_X86_SIMD)
+
+    //SSE4.1 (128-bits)
+    TARGET("sse4.1")
+    void UpdateAccumulator_SSE41(const i16* input, i16* output, const int* added, int numAdded, const int* removed, int numRemoved) {
+        const int REGISTERS = NNUE_SIZE / 8;
+        __m128i regs[REGISTERS];
+        for(int j = 0; j < REGISTERS; j++) {
+            regs[j] = _mm_load_si128( reinterpret_cast<const __m128i*>(&input[8 * j]) );
+        }
+        for(int a = 0; a < numAdded; a++) {
+            const __m128i* weights = reinterpret_cast<const __m128i*>(&NNUENetwork::weights->w1[NNUE_SIZE * added[a]]);
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm_add_epi16(regs[j], _mm_load_si128(&weights[j]));
+            }
+        }
+        for(int r = 0; r < numRemoved; r++) {
+            const __m128i* weights = reinterpret_cast<const __m128i*>(&NNUENetwork::weights->w1[NNUE_SIZE * removed[r]]);
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm_sub_epi16(regs[j], _mm_load_si128(&weights[j]));
+            }
+        }
+        for(int j = 0; j < REGISTERS; j++) {
+            _mm_store_si128( reinterpret_cast<__m128i*>(&output[8 * j]), regs[j] );
+        }
+    }
+
+    TARGET("sse4.1")
+    void ActivateAccumulator_SSE41(const i16* accumulator, u8* output) {
+        const __m128i multiplier = _mm_set1_epi16(ACTIVATION_MULTIPLIER);
+        const __m128i zero = _mm_setzero_si128();
+        for(int i = 0; i < NNUE_SIZE; i += 16) {
+            __m128i in0 = _mm_mulhrs_epi16( _mm_load_si128(reinterpret_cast<const __m128i*>(&accumulator[i + 0])), multiplier );
+            __m128i in1 = _mm_mulhrs_epi16( _mm_load_si128(reinterpret_cast<const __m128i*>(&accumulator[i + 8])), multiplier );
+            __m128i packed = _mm_max_epi8( _mm_packs_epi16(in0, in1), zero );
+            _mm_store_si128(reinterpret_cast<__m128i*>(&output[i]), packed);
+        }
+    }
+
+    TARGET("sse4.1")
+    inline int HorizontalSum128(__m128i v) {
+        const __m128i r2 = _mm_add_epi32( v, _mm_shuffle_epi32(v, 0x4E) );
+        const __m128i r1 = _mm_add_epi32( r2, _mm_shuffle_epi32(r2, 0xB1) );
+        return _mm_cvtsi128_si32(r1);
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("sse4.1")
+    void ComputeLayer_SSE41(const u8* input, int* output, const int* biases, const i8* weights) {
+        const __m128i ones = _mm_set1_epi16(1);
+        for(int o = 0; o < DIM_OUTPUT; o++) {
+            const int offset = o * DIM_INPUT;
+
+            __m128i dot = _mm_setzero_si128();
+            for(int i = 0; i < DIM_INPUT; i += 16) {
+                __m128i inputs = _mm_load_si128(reinterpret_cast<const __m128i*>(&input[i]));
+                __m128i rowWeights = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&weights[offset + i]));
+                dot = _mm_add_epi32( dot, _mm_madd_epi16(_mm_maddubs_epi16(inputs, rowWeights), ones) );
+            }
+            output[o] = biases[o] + HorizontalSum128(dot);
+        }
+    }
+
+    //Indices of the non-zero blocks of 4 inputs, by a compare + movemask of 4 blocks and a lookup.
+    //The inputs are in [0, 127]: a block is non-zero if it is > 0 as an int32.
+    //'indices' has room for DIM_INPUT / 4 + 8: the last store may write past the count
+    template<int DIM_INPUT>
+    TARGET("sse4.1")
+    int FindNonZeroBlocks_SSE41(const u8* input, u16* indices) {
+        const __m128i zero = _mm_setzero_si128();
+        int count = 0;
+        for(int i = 0; i < DIM_INPUT; i += 16) {
+            __m128i blocks = _mm_load_si128(reinterpret_cast<const __m128i*>(&input[i]));
+            int mask = _mm_movemask_ps( _mm_castsi128_ps(_mm_cmpgt_epi32(blocks, zero)) );
+            __m128i offsets = _mm_loadu_si128(reinterpret_cast<const __m128i*>(NON_ZERO_LOOKUP.indices[mask]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&indices[count]), _mm_add_epi16(_mm_set1_epi16(i / 4), offsets));
+            count += NON_ZERO_LOOKUP.count[mask];
+        }
+        return count;
+    }
+
+    //Only the columns of the non-zero blocks are accumulated: each block is broadcast and multiplied
+    //with its column of weights (4 per output)
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("sse4.1")
+    void ComputeSparseLayer_SSE41(const u8* input, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 4 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 4;
+        alignas(16) u16 indices[DIM_INPUT / 4 + 8];
+        const int count = FindNonZeroBlocks_SSE41<DIM_INPUT>(input, indices);
+
+        const __m128i ones = _mm_set1_epi16(1);
+        __m128i regs[REGISTERS];
+        for(int j = 0; j < REGISTERS; j++) {
+            regs[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&biases[4 * j]));
+        }
+        for(int k = 0; k < count; k++) {
+            const int block = indices[k];
+            const __m128i inputs = _mm_set1_epi32(InputBlock(input, block));
+            const __m128i* column = reinterpret_cast<const __m128i*>(&weights[block * DIM_OUTPUT * 4]);
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm_add_epi32( regs[j], _mm_madd_epi16(_mm_maddubs_epi16(inputs, _mm_load_si128(&column[j])), ones) );
+            }
+        }
+        for(int j = 0; j < REGISTERS; j++) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&output[4 * j]), regs[j]);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("sse4.1")
+    void ComputeLayerBatch_SSE41(const u8* input, int inputStride, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 4 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 4;
+        constexpr int TILE = std::max(1, 8 / REGISTERS); //positions whose outputs stay in registers
+        static_assert(BATCH_BLOCK_SIZE % TILE == 0);
+        const __m128i ones = _mm_set1_epi16(1);
+        for(int first = 0; first < BATCH_BLOCK_SIZE; first += TILE) {
+            __m128i regs[TILE][REGISTERS];
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    regs[p][j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&biases[4 * j]));
+                }
+            }
+            for(int block = 0; block < DIM_INPUT / 4; block++) {
+                int blocks[TILE];
+                int nonZero = 0;
+                for(int p = 0; p < TILE; p++) {
+                    blocks[p] = InputBlock(&input[(first + p) * inputStride], block);
+                    nonZero |= blocks[p];
+                }
+                if(!nonZero)
+                    continue;
+
+                const i8* column = &weights[block * DIM_OUTPUT * 4];
+                __m128i columns[REGISTERS];
+                for(int j = 0; j < REGISTERS; j++) {
+                    columns[j] = _mm_load_si128(reinterpret_cast<const __m128i*>(&column[16 * j]));
+                }
+                for(int p = 0; p < TILE; p++) {
+                    const __m128i inputs = _mm_set1_epi32(blocks[p]);
+                    for(int j = 0; j < REGISTERS; j++) {
+                        regs[p][j] = _mm_add_epi32( regs[p][j], _mm_madd_epi16(_mm_maddubs_epi16(inputs, columns[j]), ones) );
+                    }
+                }
+            }
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(&output[(first + p) * DIM_OUTPUT + 4 * j]), regs[p][j]);
+                }
+            }
+        }
+    }
+
+    //AVX2 (256-bits)
+    TARGET("avx2")
+    void UpdateAccumulator_AVX2(const i16* input, i16* output, const int* added, int numAdded, const int* removed, int numRemoved) {
+        const int REGISTERS = NNUE_SIZE / 16;
+        __m256i regs[REGISTERS];
+        for(int j = 0; j < REGISTERS; j++) {
+            regs[j] = _mm256_load_si256( reinterpret_cast<const __m256i*>(&input[16 * j]) );
+        }
+        for(int a = 0; a < numAdded; a++) {
+            const __m256i* weights = reinterpret_cast<const __m256i*>(&NNUENetwork::weights->w1[NNUE_SIZE * added[a]]);
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm256_add_epi16(regs[j], _mm256_load_si256(&weights[j]));
+            }
+        }
+        for(int r = 0; r < numRemoved; r++) {
+            const __m256i* weights = reinterpret_cast<const __m256i*>(&NNUENetwork::weights->w1[NNUE_SIZE * removed[r]]);
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm256_sub_epi16(regs[j], _mm256_load_si256(&weights[j]));
+            }
+        }
+        for(int j = 0; j < REGISTERS; j++) {
+            _mm256_store_si256( reinterpret_cast<__m256i*>(&output[16 * j]), regs[j] );
+        }
+    }
+
+    TARGET("avx2")
+    void ActivateAccumulator_AVX2(const i16* accumulator, u8* output) {
+        const __m256i multiplier = _mm256_set1_epi16(ACTIVATION_MULTIPLIER);
+        const __m256i zero = _mm256_setzero_si256();
+        for(int i = 0; i < NNUE_SIZE; i += 32) {
+            __m256i in0 = _mm256_mulhrs_epi16( _mm256_load_si256(reinterpret_cast<const __m256i*>(&accumulator[i +  0])), multiplier );
+            __m256i in1 = _mm256_mulhrs_epi16( _mm256_load_si256(reinterpret_cast<const __m256i*>(&accumulator[i + 16])), multiplier );
+
+            //Saturated to [-128, 127] within each 128-bit lane, then the lanes are put back in order
+            __m256i packed = _mm256_max_epi8( _mm256_packs_epi16(in0, in1), zero );
+            packed = _mm256_permute4x64_epi64(packed, 0xD8);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(&output[i]), packed);
+        }
+    }
+
+    TARGET("avx2")
+    inline int HorizontalSum256(__m256i v) {
+        const __m128i r4 = _mm_add_epi32( _mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1) );
+        const __m128i r2 = _mm_add_epi32( r4, _mm_shuffle_epi32(r4, 0x4E) );
+        const __m128i r1 = _mm_add_epi32( r2, _mm_shuffle_epi32(r2, 0xB1) );
+        return _mm_cvtsi128_si32(r1);
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx2")
+    void ComputeLayer_AVX2(const u8* input, int* output, const int* biases, const i8* weights) {
+        const __m256i ones = _mm256_set1_epi16(1);
+        for(int o = 0; o < DIM_OUTPUT; o++) {
+            const int offset = o * DIM_INPUT;
+
+            __m256i dot = _mm256_setzero_si256();
+            for(int i = 0; i < DIM_INPUT; i += 32) {
+                __m256i inputs = _mm256_load_si256(reinterpret_cast<const __m256i*>(&input[i]));
+                __m256i rowWeights = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&weights[offset + i]));
+
+                //u8 * i8 pairs summed to i16 (no saturation: |weights| <= 127), then to i32
+                __m256i product = _mm256_maddubs_epi16(inputs, rowWeights);
+                dot = _mm256_add_epi32( dot, _mm256_madd_epi16(product, ones) );
+            }
+            output[o] = biases[o] + HorizontalSum256(dot);
+        }
+    }
+
+    //8 blocks per compare
+    template<int DIM_INPUT>
+    TARGET("avx2")
+    int FindNonZeroBlocks_AVX2(const u8* input, u16* indices) {
+        const __m256i zero = _mm256_setzero_si256();
+        int count = 0;
+        for(int i = 0; i < DIM_INPUT; i += 32) {
+            __m256i blocks = _mm256_load_si256(reinterpret_cast<const __m256i*>(&input[i]));
+            int mask = _mm256_movemask_ps( _mm256_castsi256_ps(_mm256_cmpgt_epi32(blocks, zero)) );
+            __m128i offsets = _mm_loadu_si128(reinterpret_cast<const __m128i*>(NON_ZERO_LOOKUP.indices[mask]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&indices[count]), _mm_add_epi16(_mm_set1_epi16(i / 4), offsets));
+            count += NON_ZERO_LOOKUP.count[mask];
+        }
+        return count;
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx2")
+    void ComputeSparseLayer_AVX2(const u8* input, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 8 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 8;
+        alignas(32) u16 indices[DIM_INPUT / 4 + 8];
+        const int count = FindNonZeroBlocks_AVX2<DIM_INPUT>(input, indices);
+
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i regs[REGISTERS];
+        for(int j = 0; j < REGISTERS; j++) {
+            regs[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&biases[8 * j]));
+        }
+        for(int k = 0; k < count; k++) {
+            const int block = indices[k];
+            const __m256i inputs = _mm256_set1_epi32(InputBlock(input, block));
+            const __m256i* column = reinterpret_cast<const __m256i*>(&weights[block * DIM_OUTPUT * 4]);
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm256_add_epi32( regs[j], _mm256_madd_epi16(_mm256_maddubs_epi16(inputs, _mm256_load_si256(&column[j])), ones) );
+            }
+        }
+        for(int j = 0; j < REGISTERS; j++) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&output[8 * j]), regs[j]);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx2")
+    void ComputeLayerBatch_AVX2(const u8* input, int inputStride, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 8 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 8;
+        constexpr int TILE = std::max(1, 8 / REGISTERS); //positions whose outputs stay in registers
+        static_assert(BATCH_BLOCK_SIZE % TILE == 0);
+        const __m256i ones = _mm256_set1_epi16(1);
+        for(int first = 0; first < BATCH_BLOCK_SIZE; first += TILE) {
+            __m256i regs[TILE][REGISTERS];
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    regs[p][j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&biases[8 * j]));
+                }
+            }
+            for(int block = 0; block < DIM_INPUT / 4; block++) {
+                int blocks[TILE];
+                int nonZero = 0;
+                for(int p = 0; p < TILE; p++) {
+                    blocks[p] = InputBlock(&input[(first + p) * inputStride], block);
+                    nonZero |= blocks[p];
+                }
+                if(!nonZero)
+                    continue;
+
+                const i8* column = &weights[block * DIM_OUTPUT * 4];
+                __m256i columns[REGISTERS];
+                for(int j = 0; j < REGISTERS; j++) {
+                    columns[j] = _mm256_load_si256(reinterpret_cast<const __m256i*>(&column[32 * j]));
+                }
+                for(int p = 0; p < TILE; p++) {
+                    const __m256i inputs = _mm256_set1_epi32(blocks[p]);
+                    for(int j = 0; j < REGISTERS; j++) {
+                        regs[p][j] = _mm256_add_epi32( regs[p][j], _mm256_madd_epi16(_mm256_maddubs_epi16(inputs, columns[j]), ones) );
+                    }
+                }
+            }
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&output[(first + p) * DIM_OUTPUT + 8 * j]), regs[p][j]);
+                }
+            }
+        }
+    }
+
+    //AVX-512 (512-bits)
+    TARGET("avx512f,avx512bw")
+    void UpdateAccumulator_AVX512(const i16* input, i16* output, const int* added, int numAdded, const int* removed, int numRemoved) {
+        const int REGISTERS = NNUE_SIZE / 32;
+        __m512i regs[REGISTERS];
+        for(int j = 0; j < REGISTERS; j++) {
+            regs[j] = _mm512_load_si512( &input[32 * j] );
+        }
+        for(int a = 0; a < numAdded; a++) {
+            const i16* weights = &NNUENetwork::weights->w1[NNUE_SIZE * added[a]];
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm512_add_epi16(regs[j], _mm512_load_si512(&weights[32 * j]));
+            }
+        }
+        for(int r = 0; r < numRemoved; r++) {
+            const i16* weights = &NNUENetwork::weights->w1[NNUE_SIZE * removed[r]];
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm512_sub_epi16(regs[j], _mm512_load_si512(&weights[32 * j]));
+            }
+        }
+        for(int j = 0; j < REGISTERS; j++) {
+            _mm512_store_si512( &output[32 * j], regs[j] );
+        }
+    }
+
+    TARGET("avx512f,avx512bw")
+    void ActivateAccumulator_AVX512(const i16* accumulator, u8* output) {
+        const __m512i multiplier = _mm512_set1_epi16(ACTIVATION_MULTIPLIER);
+        const __m512i zero = _mm512_setzero_si512();
+        const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+        for(int i = 0; i < NNUE_SIZE; i += 64) {
+            __m512i in0 = _mm512_mulhrs_epi16( _mm512_load_si512(&accumulator[i +  0]), multiplier );
+            __m512i in1 = _mm512_mulhrs_epi16( _mm512_load_si512(&accumulator[i + 32]), multiplier );
+
+            //Packed within each 128-bit lane: 64-bit blocks in0, in1, in0, in1... put back in order
+            __m512i packed = _mm512_max_epi8( _mm512_packs_epi16(in0, in1), zero );
+            packed = _mm512_permutexvar_epi64(order, packed);
+            _mm512_store_si512(&output[i], packed);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx512f,avx512bw")
+    void ComputeLayer_AVX512(const u8* input, int* output, const int* biases, const i8* weights) {
+        if constexpr(DIM_INPUT % 64 != 0) {
+            ComputeLayer_AVX2<DIM_INPUT, DIM_OUTPUT>(input, output, biases, weights);
+            return;
+        }
+
+        const __m512i ones = _mm512_set1_epi16(1);
+        for(int o = 0; o < DIM_OUTPUT; o++) {
+            const int offset = o * DIM_INPUT;
+
+            __m512i dot = _mm512_setzero_si512();
+            for(int i = 0; i < DIM_INPUT; i += 64) {
+                __m512i inputs = _mm512_load_si512(&input[i]);
+                __m512i rowWeights = _mm512_loadu_si512(&weights[offset + i]);
+                dot = _mm512_add_epi32( dot, _mm512_madd_epi16(_mm512_maddubs_epi16(inputs, rowWeights), ones) );
+            }
+            output[o] = biases[o] + _mm512_reduce_add_epi32(dot);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx512f,avx512bw")
+    void ComputeSparseLayer_AVX512(const u8* input, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 16 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 16;
+        alignas(32) u16 indices[DIM_INPUT / 4 + 8];
+        const int count = FindNonZeroBlocks_AVX2<DIM_INPUT>(input, indices);
+
+        const __m512i ones = _mm512_set1_epi16(1);
+        __m512i regs[REGISTERS];
+        for(int j = 0; j < REGISTERS; j++) {
+            regs[j] = _mm512_loadu_si512(&biases[16 * j]);
+        }
+        for(int k = 0; k < count; k++) {
+            const int block = indices[k];
+            const __m512i inputs = _mm512_set1_epi32(InputBlock(input, block));
+            const i8* column = &weights[block * DIM_OUTPUT * 4];
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm512_add_epi32( regs[j], _mm512_madd_epi16(_mm512_maddubs_epi16(inputs, _mm512_load_si512(&column[64 * j])), ones) );
+            }
+        }
+        for(int j = 0; j < REGISTERS; j++) {
+            _mm512_storeu_si512(&output[16 * j], regs[j]);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx512f,avx512bw")
+    void ComputeLayerBatch_AVX512(const u8* input, int inputStride, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 16 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 16;
+        constexpr int TILE = std::max(1, 16 / REGISTERS); //positions whose outputs stay in registers
+        static_assert(BATCH_BLOCK_SIZE % TILE == 0);
+        const __m512i ones = _mm512_set1_epi16(1);
+        for(int first = 0; first < BATCH_BLOCK_SIZE; first += TILE) {
+            __m512i regs[TILE][REGISTERS];
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    regs[p][j] = _mm512_loadu_si512(&biases[16 * j]);
+                }
+            }
+            for(int block = 0; block < DIM_INPUT / 4; block++) {
+                int blocks[TILE];
+                int nonZero = 0;
+                for(int p = 0; p < TILE; p++) {
+                    blocks[p] = InputBlock(&input[(first + p) * inputStride], block);
+                    nonZero |= blocks[p];
+                }
+                if(!nonZero)
+                    continue;
+
+                const i8* column = &weights[block * DIM_OUTPUT * 4];
+                __m512i columns[REGISTERS];
+                for(int j = 0; j < REGISTERS; j++) {
+                    columns[j] = _mm512_load_si512(&column[64 * j]);
+                }
+                for(int p = 0; p < TILE; p++) {
+                    const __m512i inputs = _mm512_set1_epi32(blocks[p]);
+                    for(int j = 0; j < REGISTERS; j++) {
+                        regs[p][j] = _mm512_add_epi32( regs[p][j], _mm512_madd_epi16(_mm512_maddubs_epi16(inputs, columns[j]), ones) );
+                    }
+                }
+            }
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    _mm512_storeu_si512(&output[(first + p) * DIM_OUTPUT + 16 * j], regs[p][j]);
+                }
+            }
+        }
+    }
+
+    //AVX-512 VNNI: the u8 * i8 products are summed in groups of 4 directly into i32 (vpdpbusd)
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx512f,avx512bw,avx512vl,avx512vnni")
+    void ComputeLayer_VNNI(const u8* input, int* output, const int* biases, const i8* weights) {
+        if constexpr(DIM_INPUT % 64 != 0) {
+            for(int o = 0; o < DIM_OUTPUT; o++) {
+                const int offset = o * DIM_INPUT;
+
+                __m256i dot = _mm256_setzero_si256();
+                for(int i = 0; i < DIM_INPUT; i += 32) {
+                    __m256i inputs = _mm256_load_si256(reinterpret_cast<const __m256i*>(&input[i]));
+                    __m256i rowWeights = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&weights[offset + i]));
+                    dot = _mm256_dpbusd_epi32(dot, inputs, rowWeights);
+                }
+                output[o] = biases[o] + HorizontalSum256(dot);
+            }
+            return;
+        }
+
+        for(int o = 0; o < DIM_OUTPUT; o++) {
+            const int offset = o * DIM_INPUT;
+
+            __m512i dot = _mm512_setzero_si512();
+            for(int i = 0; i < DIM_INPUT; i += 64) {
+                __m512i inputs = _mm512_load_si512(&input[i]);
+                __m512i rowWeights = _mm512_loadu_si512(&weights[offset + i]);
+                dot = _mm512_dpbusd_epi32(dot, inputs, rowWeights);
+            }
+            output[o] = biases[o] + _mm512_reduce_add_epi32(dot);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx512f,avx512bw,avx512vl,avx512vnni")
+    void ComputeSparseLayer_VNNI(const u8* input, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 16 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 16;
+        alignas(32) u16 indices[DIM_INPUT / 4 + 8];
+        const int count = FindNonZeroBlocks_AVX2<DIM_INPUT>(input, indices);
+
+        __m512i regs[REGISTERS];
+        for(int j = 0; j < REGISTERS; j++) {
+            regs[j] = _mm512_loadu_si512(&biases[16 * j]);
+        }
+        for(int k = 0; k < count; k++) {
+            const int block = indices[k];
+            const __m512i inputs = _mm512_set1_epi32(InputBlock(input, block));
+            const i8* column = &weights[block * DIM_OUTPUT * 4];
+            for(int j = 0; j < REGISTERS; j++) {
+                regs[j] = _mm512_dpbusd_epi32(regs[j], inputs, _mm512_load_si512(&column[64 * j]));
+            }
+        }
+        for(int j = 0; j < REGISTERS; j++) {
+            _mm512_storeu_si512(&output[16 * j], regs[j]);
+        }
+    }
+
+    template<int DIM_INPUT, int DIM_OUTPUT>
+    TARGET("avx512f,avx512bw,avx512vl,avx512vnni")
+    void ComputeLayerBatch_VNNI(const u8* input, int inputStride, int* output, const int* biases, const i8* weights) {
+        static_assert(DIM_OUTPUT % 16 == 0);
+        constexpr int REGISTERS = DIM_OUTPUT / 16;
+        constexpr int TILE = std::max(1, 16 / REGISTERS); //positions whose outputs stay in registers
+        static_assert(BATCH_BLOCK_SIZE % TILE == 0);
+        for(int first = 0; first < BATCH_BLOCK_SIZE; first += TILE) {
+            __m512i regs[TILE][REGISTERS];
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    regs[p][j] = _mm512_loadu_si512(&biases[16 * j]);
+                }
+            }
+            for(int block = 0; block < DIM_INPUT / 4; block++) {
+                int blocks[TILE];
+                int nonZero = 0;
+                for(int p = 0; p < TILE; p++) {
+                    blocks[p] = InputBlock(&input[(first + p) * inputStride], block);
+                    nonZero |= blocks[p];
+                }
+                if(!nonZero)
+                    continue;
+
+                const i8* column = &weights[block * DIM_OUTPUT * 4];
+                __m512i columns[REGISTERS];
+                for(int j = 0; j < REGISTERS; j++) {
+                    columns[j] = _mm512_load_si512(&column[64 * j]);
+                }
+                for(int p = 0; p < TILE; p++) {
+                    const __m512i inputs = _mm512_set1_epi32(blocks[p]);
+                    for(int j = 0; j < REGISTERS; j++) {
+                        regs[p][j] = _mm512_dpbusd_epi32(regs[p][j], inputs, columns[j]);
+                    }
+                }
+            }
+            for(int p = 0; p < TILE; p++) {
+                for(int j = 0; j < REGISTERS; j++) {
+                    _mm512_storeu_si512(&output[(first + p) * DIM_OUTPUT + 16 * j], regs[p][j]);
+                }
+            }
+        }
+    }
+
+#endif //USE_X86_SIMD
+}
+
+//The instantiations of a version for the layers of the Architecture: sparse input in layer 2
+#define LAYER_KERNELS(ComputeSparseLayer, ComputeLayer) { nullptr, \
+    ComputeSparseLayer< ARCH[L2][ROW], ARCH[L2][COL] >, \
+    ComputeLayer< ARCH[L3][ROW], ARCH[L3][COL] >, \
+    ComputeLayer< ARCH[L4][ROW], ARCH[L4][COL] > }
+#define BATCH_KERNELS(ComputeLayerBatch) { nullptr, \
+    ComputeLayerBatch< ARCH[L2][ROW], ARCH[L2][COL] >, \
+    ComputeLayerBatch< ARCH[L3][ROW], ARCH[L3][COL] >, \
+    nullptr }
+
+Kernels kernels = { SIMD_SCALAR, UpdateAccumulator_Scalar, ActivateAccumulator_Scalar, LAYER_KERNELS(ComputeSparseLayer_Scalar, ComputeLayer_Scalar), BATCH_KERNELS(ComputeLayerBatch_Scalar) }; //until Init
+
+void Init() {
+    Init(DetectLevel());
+}
+
+void Init(SIMD_LEVEL level) {
+    assert(level <= DetectLevel());
+
+    switch(level) {
+#if defined(USE_X86_SIMD)
+        case SIMD_AVX512_VNNI:
+            kernels = { level, UpdateAccumulator_AVX512, ActivateAccumulator_AVX512, LAYER_KERNELS(ComputeSparseLayer_VNNI, ComputeLayer_VNNI), BATCH_KERNELS(ComputeLayerBatch_VNNI) };
+            break;
+        case SIMD_AVX512:
+            kernels = { level, UpdateAccumulator_AVX512, ActivateAccumulator_AVX512, LAYER_KERNELS(ComputeSparseLayer_AVX512, ComputeLayer_AVX512), BATCH_KERNELS(ComputeLayerBatch_AVX512) };
+            break;
+        case SIMD_AVX2:
+            kernels = { level, UpdateAccumulator_AVX2, ActivateAccumulator_AVX2, LAYER_KERNELS(ComputeSparseLayer_AVX2, ComputeLayer_AVX2), BATCH_KERNELS(ComputeLayerBatch_AVX2) };
+            break;
+        case SIMD_SSE41:
+            kernels = { level, UpdateAccumulator_SSE41, ActivateAccumulator_SSE41, LAYER_KERNELS(ComputeSparseLayer_SSE41, ComputeLayer_SSE41), BATCH_KERNELS(ComputeLayerBatch_SSE41) };
+            break;
+#endif
+        default:
+            kernels = { SIMD_SCALAR, UpdateAccumulator_Scalar, ActivateAccumulator_Scalar, LAYER_KERNELS(ComputeSparseLayer_Scalar, ComputeLayer_Scalar), BATCH_KERNELS(ComputeLayerBatch_Scalar) };
+            break;
+    }
+}
+
+SIMD_LEVEL DetectLevel() {
+#if defined(USE_X86_SIMD) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        if(__builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vnni"))
+            return SIMD_AVX512_VNNI;
+        return SIMD_AVX512;
+    }
+    if(__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if(__builtin_cpu_supports("sse4.1"))
+        return SIMD_SSE41;
+#elif defined(USE_X86_SIMD)
+    //Other compilers: the instruction sets enabled in the build
+    #if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        return SIMD_AVX512_VNNI;
+    #elif defined(__AVX512BW__)
+        return SIMD_AVX512;
+    #elif defined(__AVX2__)
+        return SIMD_AVX2;
+    #else
+        return SIMD_SSE41;
+    #endif
+#endif
+    return SIMD_SCALAR;
+}
+
+std::string LevelName(SIMD_LEVEL level) {
+    switch(level) {
+        case SIMD_AVX512_VNNI: return "AVX-512 VNNI";
+        case SIMD_AVX512: return "AVX-512";
+        case SIMD_AVX2:   return "AVX2";
+        case SIMD_SSE41:  return "SSE4.1";
+        default:          return "scalar";
+    }
+}
+
+}
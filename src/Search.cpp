@@ -2,11 +2,12 @@
 
 #include "Evaluation.h"
 #include "MoveGenerator.h"
+#include "MovePicker.h"
 #include "NNUE.h" //JUST FOR THE PV
 #include "Uci.h"
 using namespace Sorting;
 
-#include <algorithm> //max()
+#include <algorithm> //max(), clamp(), find()
 #include <cmath> //INFINITY
 #include <iomanip> //debug output
 
@@ -24,7 +25,43 @@ const int UCI_OUTPUT_CURRMOVE_MINTIME = 1000; //ms
 
 #define DRAW_SCORE(ply) (ply & 1 ? 10 : -10)
 
-Search::Search() {
+namespace {
+    //The evaluation tables of a search, bound to its thread while it runs
+    struct BoundTables {
+        BoundTables(PawnHash* pawnHash, EvalCache* evalCache) {
+            Hash::pawnHash = pawnHash;
+            Hash::evalCache = evalCache;
+        }
+        ~BoundTables() {
+            Hash::pawnHash = nullptr;
+            Hash::evalCache = nullptr;
+        }
+    };
+
+    //Legal move matching a compact move (e.g. from the transposition table). Null move if none
+    Move FindLegalMove(Board &board, u16 compactMove) {
+        MoveGenerator gen;
+        MoveList& moves = gen.GenerateMoves(board);
+        auto it = std::find_if(moves.begin(), moves.end(), [compactMove](Move move) { return move.Compact() == compactMove; });
+        return it != moves.end() ? *it : Move();
+    }
+
+    //Reply to the best move stored in the transposition table
+    Move PonderMove(Board &board, Move bestMove) {
+        Board newBoard = board;
+        newBoard.MakeMove(bestMove, false);
+
+        std::optional<TTEntry> ttEntry = Hash::tt.ProbeEntry(newBoard.ZKey(), 0);
+        if(ttEntry && ttEntry->bestMove)
+            return FindLegalMove(newBoard, ttEntry->bestMove);
+        return Move();
+    }
+}
+
+Search::Search(bool isHelper) {
+    m_isHelper = isHelper;
+    m_threadId = 0;
+
     m_maxDepth = MAX_DEPTH;
     m_allocatedTime = 3500;
     m_forcedTime = INFINITE;
@@ -38,11 +75,14 @@ Search::Search() {
     ClearSearch();
     m_heuristics.history.Clear();
 
-    Hash::tt.Clear();
-    Hash::pawnHash.Clear();
+    //Helpers share the transposition table of the main search
+    if(!m_isHelper) {
+        Hash::tt.Clear();
+    }
 }
 
 void Search::ClearSearch() {
+    m_completedDepth = 0;
     m_elapsedTime = 0;
     m_nodes = 0;
     m_nps = 0;
@@ -59,13 +99,24 @@ void Search::ClearSearch() {
 }
 
 void Search::IterativeDeepening(Board &board) {
+    BoundTables tables(&m_pawnHash, &m_evalCache);
     m_searchCount++;
 
     m_clock.Start();
-    ClearSearch();
+    if(!m_isHelper)
+        ClearSearch(); //helpers are cleared by StartHelpers, before their thread starts
     m_heuristics.history.Age();
 
-    for(m_depth = 1; m_depth <= m_maxDepth; m_depth++) {
+    //The accumulators are not updated while the classical evaluation is in use
+    board.ResetNNUE();
+
+    if(!m_isHelper)
+        StartHelpers(board);
+
+    //Half of the helpers start one ply deeper, to desynchronize the threads
+    int startDepth = 1 + (m_threadId & 1);
+
+    for(m_depth = startDepth; m_depth <= m_maxDepth; m_depth++) {
         assert(m_ply == 0);
         assert(m_plyqs == 0);
         assert(m_nullmoveAllowed);
@@ -97,8 +148,13 @@ void Search::IterativeDeepening(Board &board) {
 
         if(m_stop)
             break;
+        m_completedDepth = m_depth;
+
+        if(m_isHelper)
+            continue;
+
         m_elapsedTime = ElapsedTime();
-        m_nps = static_cast<int>(1000 * m_nodes / (m_elapsedTime+1));
+        m_nps = static_cast<int>(1000 * TotalNodes() / (m_elapsedTime+1));
 
         //PV
         std::string PV;
@@ -106,11 +162,14 @@ void Search::IterativeDeepening(Board &board) {
         Board newBoard = board;
         assert(newBoard == board);
         for(int depth = 1; depth <= m_depth; depth++) {
-            TTEntry *ttEntry = Hash::tt.ProbeEntry(newBoard.ZKey(), 0);
+            std::optional<TTEntry> ttEntry = Hash::tt.ProbeEntry(newBoard.ZKey(), 0);
             if(!ttEntry) continue;
-            if(ttEntry->bestMove.MoveType() == NULLMOVE) break;
+            if(!ttEntry->bestMove) break;
+
+            //Key collisions and helper threads may leave a move of another position
+            Move bestMove = FindLegalMove(newBoard, ttEntry->bestMove);
+            if(bestMove.MoveType() == NULLMOVE) break;
 
-            Move bestMove = ttEntry->bestMove;
             PV += bestMove.Notation();
             PV += " ";
 
@@ -129,6 +188,24 @@ void Search::IterativeDeepening(Board &board) {
         D( m_debug.Print() );
     }
 
+    if(m_isHelper)
+        return;
+
+    StopHelpers();
+
+    //Use the result of the deepest search among all the threads
+    Search* bestThread = BestThread();
+    if(bestThread != this) {
+        m_bestMove = bestThread->m_bestMove;
+        m_bestScore = bestThread->m_bestScore;
+        m_ponderMove = PonderMove(board, m_bestMove);
+    }
+
+    if(m_debugMode) {
+        std::cout << "info string EvalCache probes " << m_evalCache.Probes()
+                  << " hitrate " << 100 * m_evalCache.HitRate() << "%" << std::endl;
+    }
+
     if(UCI_OUTPUT) {
         std::cout << "bestmove " << m_bestMove.Notation();
         if(UCI_PONDER)
@@ -147,7 +224,7 @@ void Search::UciOutput(std::string PV) {
         std::cout << " score cp " << m_bestScore;
     }
     std::cout << " time " << m_elapsedTime;
-    std::cout << " nodes " << m_nodes;
+    std::cout << " nodes " << TotalNodes();
     std::cout << " nps " << m_nps;
     if(m_elapsedTime > 1000)
         std::cout << " hashfull " << Hash::tt.OccupancyPerMil();
@@ -172,6 +249,79 @@ void Search::Infinite() {
     m_allocatedTime = INFINITE;
 }
 
+void Search::ClearEvalTables() {
+    m_pawnHash.Clear();
+    m_evalCache.Clear();
+    for(auto& helper : m_helpers) {
+        helper->ClearEvalTables();
+    }
+}
+
+//Lazy SMP
+void Search::SetThreads(int threads) {
+    threads = std::clamp(threads, 1, MAX_THREADS);
+
+    m_helpers.clear();
+    for(int i = 1; i < threads; i++) {
+        m_helpers.push_back( std::make_unique<Search>(true) );
+        m_helpers.back()->m_threadId = i;
+    }
+}
+
+//The helpers are reset here, on the main thread: a Stop() sent while a helper is starting is not lost
+void Search::StartHelpers(Board &board) {
+    Limits limits;
+    limits.infinite = true; //no time or node limit: stopped by the main search
+
+    for(auto& helper : m_helpers) {
+        helper->AllocateLimits(board, limits);
+        helper->m_maxDepth = m_maxDepth;
+        helper->m_searchCount = m_searchCount - 1; //same TT age as the main search
+        helper->m_bestMove = Move();
+        helper->m_bestScore = -INFINITE_SCORE;
+        helper->ClearSearch();
+
+        //Each helper works on its own copy of the board
+        m_helperThreads.emplace_back([helper = helper.get(), board]() mutable {
+            helper->IterativeDeepening(board);
+        });
+    }
+}
+
+void Search::StopHelpers() {
+    for(auto& helper : m_helpers) {
+        helper->Stop();
+    }
+    for(auto& thread : m_helperThreads) {
+        thread.join();
+    }
+    m_helperThreads.clear();
+}
+
+//Deepest completed iteration. Ties are resolved by the best score
+Search* Search::BestThread() {
+    Search* bestThread = this;
+    for(auto& helper : m_helpers) {
+        if(helper->m_bestMove.MoveType() == NULLMOVE)
+            continue;
+
+        bool deeper = helper->m_completedDepth > bestThread->m_completedDepth;
+        bool better = helper->m_completedDepth == bestThread->m_completedDepth
+                   && helper->m_bestScore > bestThread->m_bestScore;
+        if(deeper || better)
+            bestThread = helper.get();
+    }
+    return bestThread;
+}
+
+u64 Search::TotalNodes() const {
+    u64 nodes = m_nodes;
+    for(auto& helper : m_helpers) {
+        nodes += helper->m_nodes;
+    }
+    return nodes;
+}
+
 int Search::RootMax(Board &board, int depth, int alpha, int beta) {
     Move bestMove;
     int score;
@@ -181,7 +331,7 @@ int Search::RootMax(Board &board, int depth, int alpha, int beta) {
     D( m_debug.Increment("RootMax Hit") );
 
     MoveGenerator gen;
-    MoveList moves = gen.GenerateMoves(board);
+    MoveList& moves = gen.GenerateMoves(board);
 
     D( if(depth == 1) P("Number of moves in root position: " << moves.size()) );
 
@@ -192,14 +342,14 @@ int Search::RootMax(Board &board, int depth, int alpha, int beta) {
         moveNumber++;
 
         //Uci output
-        if(m_elapsedTime > UCI_OUTPUT_CURRMOVE_MINTIME) {
+        if(!m_isHelper && m_elapsedTime > UCI_OUTPUT_CURRMOVE_MINTIME) {
             std::cout << "info currmovenumber " << moveNumber;
             std::cout << " currmove " << move.Notation();
             std::cout << std::endl;
         }
 
         board.MakeMove(move);
-        m_ply++; m_nodes++;
+        m_ply++; IncrementNodes();
 
         score = -NegaMax(board, depth-1, -beta, -alpha);
 
@@ -228,7 +378,7 @@ int Search::RootMax(Board &board, int depth, int alpha, int beta) {
         m_bestMove = bestMove;
         m_bestScore = alpha;
 
-        Hash::tt.AddEntry(board.ZKey(), m_bestScore, TTENTRY_TYPE::EXACT, m_bestMove, depth, m_ply, m_searchCount);
+        Hash::tt.AddEntry(board.ZKey(), m_bestScore, TT_NO_EVAL, TTENTRY_TYPE::EXACT, m_bestMove, depth, m_ply, m_searchCount);
     }
 
     return alpha;
@@ -283,8 +433,8 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
     int bestScore = -INFINITE_SCORE;
     int alphaOriginal = alpha; //for later calculation of TTENTRY_TYPE
     
-    TTEntry* ttEntry = Hash::tt.ProbeEntry(board.ZKey(), depth);
-    if(ttEntry && !isPV) {
+    std::optional<TTEntry> ttEntry = Hash::tt.ProbeEntry(board.ZKey(), 0);
+    if(ttEntry && ttEntry->depth >= depth && !isPV) {
         D( m_debug.Increment("TT Hits (in NegaMax)") );
         int score = Hash::tt.ScoreFromHash(ttEntry->score, m_ply);
         if( (ttEntry->type == TTENTRY_TYPE::UPPER_BOUND && score <= alpha)
@@ -296,12 +446,18 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
         }
     }
 
-    //Calculate evaluation once at start, for pruning purposes
+    //Calculate evaluation once at start, for pruning purposes. Reused from the TT if available
     int eval = 0;
     if(!inCheck) {
-        D( m_debug.Increment("NegaMax Calls to Evaluation") );
-        eval = Evaluation::Evaluate(board);
+        if(ttEntry && ttEntry->eval != TT_NO_EVAL) {
+            eval = ttEntry->eval;
+        }
+        else {
+            D( m_debug.Increment("NegaMax Calls to Evaluation") );
+            eval = Evaluation::Evaluate(board);
+        }
     }
+    const int ttEval = inCheck ? TT_NO_EVAL : eval;
 
     // --- Static null-move pruning (aka Reverse futility) ---
     const int staticMargin = 125;
@@ -347,40 +503,34 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
             D( m_debug.Increment("NullMove Cut-offs - Depth " + std::to_string(depth)) );
             if(IsMateValue(nullScore))
                 nullScore = beta;  //to avoid false mates in zugzwang
-            Hash::tt.AddEntry(board.ZKey(), nullScore, TTENTRY_TYPE::LOWER_BOUND, Move(), nullDepth, m_ply, m_searchCount);
+            Hash::tt.AddEntry(board.ZKey(), nullScore, ttEval, TTENTRY_TYPE::LOWER_BOUND, Move(), nullDepth, m_ply, m_searchCount);
             return nullScore;
         }
     }
     //Allow non-consecutive null-move pruning
     m_nullmoveAllowed = true;
 
-    // --------- Generate the moves -----------
-    MoveGenerator gen;
-    MoveList moves = gen.GenerateMoves(board);
+    // --------- Move picker -----------
+    //Moves are generated in stages, as they are needed
+    MovePicker picker(board, ttEntry ? ttEntry->bestMove : 0, m_heuristics, m_ply);
 
-    D( m_debug.Increment("NegaMax GenerateMoves Hits") );
+    D( m_debug.Increment("NegaMax MovePicker Hits") );
 
-    //----- One-reply extension -------
-    if(moves.size() == 1) {
-        D( m_debug.Increment("Extension One-reply") );
-        extension++;
-    }
-
-    // --------- Check for checkmate and stalemate -----------
-    if( moves.empty() ) {
-        if(inCheck) {
+    // --------- Check for checkmate -----------
+    //Stalemate is detected after the move loop
+    if(inCheck) {
+        if(picker.NumEvasions() == 0) {
             D( m_debug.Increment("NegaMax Checkmate") );
             return -MATESCORE + m_ply; //checkmate
         }
-        else {
-            D( m_debug.Increment("NegaMax Stalemate") );
-            return DRAW_SCORE(m_ply); //stalemate
+
+        //----- One-reply extension -------
+        if(picker.NumEvasions() == 1) {
+            D( m_debug.Increment("Extension One-reply") );
+            extension++;
         }
     }
 
-    // --------- Sort moves -----------
-    SortMoves(board, moves, Hash::tt, m_heuristics, m_ply);
-
     // ------- Futility pruning --------
     //Prune quiet moves in the loop?
     bool doFutility = false;
@@ -394,8 +544,8 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
     }
 
     int moveNumber = 0;
-    for(auto move : moves) {
-        assert(move.MoveType());
+    Move move;
+    while( (move = picker.NextMove()).MoveType() != NULLMOVE ) {
 
         moveNumber++;
         int score, reduction = 0;
@@ -406,13 +556,16 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
 #endif
 
         // ------- Futility pruning --------
-        //Don't prune: hash move, promotions, SEE > 0 captures
+        //Don't prune: hash move, promotions, SEE > 0 captures.
+        //The moves after the good captures are sorted by score: the rest are futile too
         const int SEE_ZERO = 240;
         if(doFutility && move.Score() <= SEE_ZERO) {
             D( m_debug.Increment("Futility - FutileMove - " + std::to_string(depth)) );
             if(eval + futilityMargin > bestScore) {
                 bestScore = eval + futilityMargin;
             }
+            if(picker.InGoodCaptures())
+                continue;
             break;
         }
 
@@ -441,7 +594,7 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
         }
 
         board.MakeMove(move);
-        m_ply++; m_nodes++;
+        m_ply++; IncrementNodes();
 
         // -------- Principal Variation Search -----------
         int fullDepth = depth - 1 + extension + localExtension;
@@ -477,7 +630,7 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
             if(score >= beta) {
                 D( m_debug.Increment("NegaMax Cutoffs (score >= beta)") );
 
-                Hash::tt.AddEntry(board.ZKey(), score, TTENTRY_TYPE::LOWER_BOUND, move, depth, m_ply, m_searchCount);
+                Hash::tt.AddEntry(board.ZKey(), score, ttEval, TTENTRY_TYPE::LOWER_BOUND, move, depth, m_ply, m_searchCount);
 
                 //update heuristics
                 if( move.IsQuiet() ) {
@@ -493,9 +646,15 @@ int Search::NegaMax(Board &board, int depth, int alpha, int beta) {
         
     } //move loop
 
+    // --------- Check for stalemate -----------
+    if(moveNumber == 0) {
+        D( m_debug.Increment("NegaMax Stalemate") );
+        return DRAW_SCORE(m_ply); //stalemate
+    }
+
     if(bestMove.MoveType() != 0) {
         TTENTRY_TYPE type = (alpha > alphaOriginal) ? TTENTRY_TYPE::EXACT : TTENTRY_TYPE::UPPER_BOUND;
-        Hash::tt.AddEntry(board.ZKey(), bestScore, type, bestMove, depth, m_ply, m_searchCount);
+        Hash::tt.AddEntry(board.ZKey(), bestScore, ttEval, type, bestMove, depth, m_ply, m_searchCount);
     }
 
     return bestScore;
@@ -511,10 +670,13 @@ int Search::QuiescenceSearch(Board &board, int alpha, int beta) {
     int bestScore = -INFINITE_SCORE;
     bool inCheck = board.IsCheck();
 
+    std::optional<TTEntry> ttEntry = Hash::tt.ProbeEntry(board.ZKey(), 0);
+
     //--------- Standpat -----------
     int standPat = 0;
     if(!inCheck) {
-        standPat = Evaluation::Evaluate(board);
+        standPat = (ttEntry && ttEntry->eval != TT_NO_EVAL) ? ttEntry->eval
+                                                            : Evaluation::Evaluate(board);
 
         if(standPat > alpha) {
             if(standPat >= beta)
@@ -525,7 +687,6 @@ int Search::QuiescenceSearch(Board &board, int alpha, int beta) {
     }
     
     // --------- Transposition table lookup -----------
-    TTEntry* ttEntry = Hash::tt.ProbeEntry(board.ZKey(), 0);
     if(ttEntry && !isPV) {
         int score = Hash::tt.ScoreFromHash(ttEntry->score, m_ply);
         if( (ttEntry->type == TTENTRY_TYPE::UPPER_BOUND && score <= alpha)
@@ -539,7 +700,7 @@ int Search::QuiescenceSearch(Board &board, int alpha, int beta) {
 
     //-------- Generate moves ----------
     MoveGenerator gen;
-    MoveList moves = inCheck ? gen.GenerateMoves(board)
+    MoveList& moves = inCheck ? gen.GenerateMoves(board)
                              : gen.GenerateCaptures(board);
 
     D( m_debug.Increment("Quiescence GenerateMoves") );
@@ -550,7 +711,7 @@ int Search::QuiescenceSearch(Board &board, int alpha, int beta) {
             D( m_debug.Increment("Quiescence Checkmate") );
             return -MATESCORE + m_ply; //checkmate
         }
-        else if( gen.GenerateMoves(board).empty() ) {
+        else if( MoveGenerator().GenerateMoves(board).empty() ) { //another generator: "moves" is reused
             D( m_debug.Increment("Quiescence Stalemate") );
             return DRAW_SCORE(m_ply); //stalemate
         }
@@ -582,7 +743,7 @@ int Search::QuiescenceSearch(Board &board, int alpha, int beta) {
         D( Board bef = board );
 
         board.MakeMove(move);
-        m_ply++; m_plyqs++; m_nodes++; m_selPly = std::max(m_selPly, m_ply);
+        m_ply++; m_plyqs++; IncrementNodes(); m_selPly = std::max(m_selPly, m_ply);
         D( m_debug.Increment("Quiescence Nodes") );
 
         int score = -QuiescenceSearch(board, -beta, -alpha);
@@ -617,6 +778,14 @@ bool Search::TimeOver() {
     return false;
 }
 
+//The node limit is for all the threads, as reported by the UCI output. Adding up the helpers
+//is checked every N nodes, as the time
+bool Search::NodeLimit() {
+    if(m_helpers.empty())
+        return m_nodes.load(std::memory_order_relaxed) >= m_forcedNodes;
+    return (m_nodesTimeCheck & 1023) == 0 && TotalNodes() >= m_forcedNodes;
+}
+
 void Search::AllocateLimits(Board &board, Limits limits) {
     m_limits = limits;
     m_nodes = 0;
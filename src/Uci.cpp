@@ -3,7 +3,9 @@
 #include "Board.h"
 #include "Evaluation.h"
 #include "Hash.h"
+#include "MoveGenerator.h"
 #include "NNUE.h"
+#include "NNUEKernels.h"
 
 #include <iostream>
 #include <string>
@@ -23,6 +25,20 @@ namespace {
     const std::string VERSION_MAJOR = "0";
     const std::string VERSION_MINOR = "8";
     const std::string VERSION_PATCH = "0";
+
+    // Standard test positions for chess engine benchmarking
+    const std::vector<std::string> BENCH_POSITIONS = {
+        "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", // Starting position
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", // Kiwipete
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", // Position 3
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", // Position 4
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", // Position 5
+        "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", // Position 6
+        "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 1", // Sicilian
+        "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R b KQkq - 3 2", // Sicilian after Nf3
+        "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 4 3", // Sicilian after Nf3 Nf6
+        "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R b KQkq - 5 3"  // Sicilian after Nf3 Nf6 e3
+    };
 }
 
 Uci::Uci() :
@@ -47,11 +63,13 @@ void Uci::Launch() {
             std::cout << "id author " << AUTHOR << std::endl;
 
             //Options
-            std::cout << "option name Hash type spin default " << DEFAULT_HASH_SIZE << " min 1 max 4096" << std::endl;
+            std::cout << "option name Hash type spin default " << DEFAULT_HASH_SIZE << " min 1 max " << MAX_HASH_SIZE << std::endl;
+            std::cout << "option name Threads type spin default 1 min 1 max " << MAX_THREADS << std::endl;
             std::cout << "option name Ponder type check default false" << std::endl;
             std::cout << "option name ClearHash type button" << std::endl;
             std::cout << "option name ClassicalEval type check default false" << std::endl;
-            std::cout << "option name NNUE_Path type string default " << nnue.GetPath() << std::endl;
+            std::cout << "option name NNUE_Path type string default " << NNUENetwork::GetPath() << std::endl;
+            std::cout << "info string NNUE kernels " << NNUEKernels::LevelName(NNUEKernels::kernels.level) << std::endl;
 
             std::cout << "uciok" << std::endl;
         }
@@ -110,19 +128,6 @@ void Uci::Launch() {
             
             std::cout << "Running benchmark at depth " << depth << "..." << std::endl;
             
-            // Standard test positions for chess engine benchmarking
-            std::vector<std::string> testPositions = {
-                "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", // Starting position
-                "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", // Kiwipete
-                "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", // Position 3
-                "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", // Position 4
-                "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", // Position 5
-                "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", // Position 6
-                "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 1", // Sicilian
-                "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R b KQkq - 3 2", // Sicilian after Nf3
-                "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 4 3", // Sicilian after Nf3 Nf6
-                "rnbqkb1r/pppp1ppp/5n2/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R b KQkq - 5 3"  // Sicilian after Nf3 Nf6 e3
-            };
             
             u64 totalNodes = 0;
             int totalTime = 0;
@@ -132,12 +137,13 @@ void Uci::Launch() {
             // Disable UCI output during benchmark
             bool originalUciOutput = UCI_OUTPUT;
             UCI_OUTPUT = false;
+            m_search.GetEvalCache().ClearStats();
             
-            for(size_t i = 0; i < testPositions.size(); i++) {
-                std::cout << "Position " << (i + 1) << "/" << testPositions.size() << ":" << std::endl;
+            for(size_t i = 0; i < BENCH_POSITIONS.size(); i++) {
+                std::cout << "Position " << (i + 1) << "/" << BENCH_POSITIONS.size() << ":" << std::endl;
                 
                 // Set position
-                m_board.SetFen(testPositions[i]);
+                m_board.SetFen(BENCH_POSITIONS[i]);
                 
                 // Set search limits
                 Limits limits;
@@ -146,7 +152,7 @@ void Uci::Launch() {
                 
                 // Clear hash table for fair comparison
                 Hash::tt.Clear();
-                Hash::pawnHash.Clear();
+                m_search.ClearEvalTables();
                 
                 // Run search
                 m_search.AllocateLimits(m_board, limits);
@@ -179,8 +185,16 @@ void Uci::Launch() {
             std::cout << "Total nodes: " << totalNodes << std::endl;
             std::cout << "Total time: " << totalTime << " ms" << std::endl;
             std::cout << "Average speed: " << std::fixed << std::setprecision(2) << (avgNps / 1000.0) << " kN/s" << std::endl;
+            EvalCache& evalCache = m_search.GetEvalCache();
+            std::cout << "Eval cache: probes " << evalCache.Probes() << ", hits " << evalCache.Hits()
+                      << " (" << 100 * evalCache.HitRate() << "%)" << std::endl;
             std::cout << "========================" << std::endl;
         }
+        else if(token == "evalbench") {
+            int iterations = 1000;
+            stream >> iterations;
+            EvalBench(iterations);
+        }
         else if(token == "hashmoves") {
             m_board.ShowHashMoves();
         }
@@ -287,7 +301,16 @@ void Uci::SetOption(std::istringstream &stream) {
             stream >> token;
             P(token);
 
-            Hash::tt.SetSize( stoi(token) );
+            Hash::tt.SetSize( stoull(token) );
+        }
+        else if(token == "Threads") {
+            stream >> token; //should be 'value'
+            if(token != "value")
+                return;
+            stream >> token;
+            P(token);
+
+            m_search.SetThreads( stoi(token) );
         }
         else if(token == "Ponder") {
             stream >> token; //should be 'value'
@@ -315,6 +338,8 @@ void Uci::SetOption(std::istringstream &stream) {
                 UCI_CLASSICAL_EVAL = true;
             else if(token == "false")
                 UCI_CLASSICAL_EVAL = false;
+            Hash::tt.Clear(); //stored static evals belong to the previous evaluation
+            m_search.ClearEvalTables();
         }
         else if(token == "NNUE_Path") {
             stream >> token;
@@ -322,7 +347,9 @@ void Uci::SetOption(std::istringstream &stream) {
                 return;
             stream >> token;
 
-            nnue.Load(token);
+            NNUENetwork::Load(token);
+            Hash::tt.Clear(); //stored static evals belong to the previous network
+            m_search.ClearEvalTables();
         }
         else {
             std::cout << "Unknown option: " << token << std::endl;
@@ -331,6 +358,75 @@ void Uci::SetOption(std::istringstream &stream) {
     }
 }
 
+//Speed of the NNUE evaluation with each kernel level supported by the CPU.
+//Every legal move of the bench positions is made, evaluated and taken back 'iterations' times,
+//so the incremental update and the layer propagation are both measured.
+//The same positions are also evaluated at once by NNUEBatch, with all the cores
+void Uci::EvalBench(int iterations) {
+    bool classicalEval = UCI_CLASSICAL_EVAL;
+    UCI_CLASSICAL_EVAL = false;
+
+    std::vector<BatchPosition> batch;
+    for(const auto &fen : BENCH_POSITIONS) {
+        Board board;
+        board.SetFen(fen);
+        MoveGenerator generator;
+        for(auto move : generator.GenerateMoves(board)) {
+            board.MakeMove(move);
+            batch.push_back(NNUEBatch::FromBoard(board));
+            board.TakeMove(move);
+        }
+    }
+
+    SIMD_LEVEL best = NNUEKernels::DetectLevel();
+    for(int level = SIMD_SCALAR; level <= best; level++) {
+        NNUEKernels::Init(SIMD_LEVEL(level));
+
+        u64 evals = 0;
+        int64_t checksum = 0;
+        int64_t elapsed = 0;
+        for(const auto &fen : BENCH_POSITIONS) {
+            Board board;
+            board.SetFen(fen);
+            MoveGenerator generator;
+            MoveList moves = generator.GenerateMoves(board);
+
+            Utils::Clock clock;
+            clock.Start();
+            for(int i = 0; i < iterations; i++) {
+                for(auto move : moves) {
+                    board.MakeMove(move);
+                    checksum += board.GetNNUE().Evaluate(board);
+                    board.TakeMove(move);
+                }
+            }
+            elapsed += clock.ElapsedNanoseconds();
+            evals += u64(iterations) * moves.size();
+        }
+
+        std::cout << std::left << std::setw(14) << NNUEKernels::LevelName(SIMD_LEVEL(level))
+                  << " evals " << evals
+                  << " ns/eval " << std::fixed << std::setprecision(1) << (evals ? double(elapsed) / evals : 0.0)
+                  << " checksum " << checksum << std::endl;
+
+        checksum = 0;
+        Utils::Clock clock;
+        clock.Start();
+        for(int i = 0; i < iterations; i++) {
+            for(int score : NNUEBatch::Evaluate(batch))
+                checksum += score;
+        }
+        const double batchEvals = double(iterations) * batch.size();
+        std::cout << std::left << std::setw(14) << "  batch"
+                  << " evals " << u64(batchEvals)
+                  << " ns/eval " << std::fixed << std::setprecision(1) << (batchEvals ? clock.ElapsedNanoseconds() / batchEvals : 0.0)
+                  << " checksum " << checksum << std::endl;
+    }
+
+    NNUEKernels::Init();
+    UCI_CLASSICAL_EVAL = classicalEval;
+}
+
 void Uci::StartSearch() {
     m_search.IterativeDeepening(m_board);
 }
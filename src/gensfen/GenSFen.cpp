@@ -314,7 +314,7 @@ void GenSFen::WriteEvals(Board& board, Search& search, std::ofstream& outputFile
 
 bool GenSFen::NoMoves(Board& board) {
     MoveGenerator gen;
-    MoveList moves = gen.GenerateMoves(board);
+    MoveList& moves = gen.GenerateMoves(board);
     return (moves.size() == 0);
 }
 
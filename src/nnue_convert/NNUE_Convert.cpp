@@ -13,7 +13,44 @@ float GetNumber(std::ifstream& ifile) {
     return decimal;
 }
 
-void Convert(std::string ifilename, std::string ofilename) {
+//Quantization of the engine (int16 layer 1, int8 hidden layers), written in the format that the engine maps
+bool WriteQuantized(const NetworkStorage& nnue_storage, std::string ofilename) {
+    Network* network = new Network;
+    int saturated = QuantizeNetwork(nnue_storage, *network);
+    if(saturated)
+        std::cout << "Watch out! " << saturated << " parameters saturated by the quantization" << std::endl;
+
+    std::cout << "Writting quantized network (version " << NETWORK_VERSION << ") to: " << ofilename << std::endl;
+    bool saved = NNUENetwork::Save(ofilename, *network);
+    delete network;
+    return saved;
+}
+
+//A float binary (.nn/.nnue) to the quantized format
+bool Quantize(std::string ifilename, std::string ofilename) {
+    std::ifstream ifile;
+    ifile.open(ifilename, std::ifstream::binary);
+
+    if(!ifile.is_open()) {
+        std::cout << "ERROR: file not found: " << ifilename << std::endl;
+        return false;
+    }
+
+    std::cout << "Quantizing network: " << ifilename << std::endl;
+
+    NetworkStorage* nnue_storage = new NetworkStorage;
+    ifile.read((char*)nnue_storage, sizeof(NetworkStorage));
+    bool quantized = false;
+    if(ifile.gcount() == sizeof(NetworkStorage))
+        quantized = WriteQuantized(*nnue_storage, ofilename);
+    else
+        std::cout << "ERROR: not a float network: " << ifilename << std::endl;
+
+    delete nnue_storage;
+    return quantized;
+}
+
+void Convert(std::string ifilename, std::string ofilename, std::string qfilename) {
     //Read model parameters from plain .txt
     std::ifstream ifile;
     ifile.open(ifilename);
@@ -81,6 +118,8 @@ void Convert(std::string ifilename, std::string ofilename) {
 
     ifile.close();
 
+    WriteQuantized(*nnue_storage, qfilename);
+
     //Write binary file
     std::ofstream ofile;
     ofile.open(ofilename, std::ofstream::binary);
@@ -92,11 +131,25 @@ void Convert(std::string ifilename, std::string ofilename) {
 
     ofile.write((char*)nnue_storage, sizeof(NetworkStorage));
     ofile.close();
+    delete nnue_storage;
 }
 
+//nnue_convert model.txt: float (.nn) and quantized (.qnn) networks
+//nnue_convert network.nnue: a float network to the quantized format (.qnn)
+//The quantized file can be named by a second argument (used by the build to embed the network)
 int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cout << "Usage: nnue_convert <model.txt | network.nnue> [quantized.qnn]" << std::endl;
+        return 1;
+    }
+
     std::filesystem::path filepath = argv[1];
     std::string inputFile = filepath.string();
-    std::string outputFile = filepath.replace_extension(".nn").string();
-    Convert(inputFile, outputFile);
+    std::string quantizedFile = argc > 2 ? argv[2] : std::filesystem::path(filepath).replace_extension(".qnn").string();
+    if(filepath.extension() == ".txt") {
+        std::string outputFile = std::filesystem::path(filepath).replace_extension(".nn").string();
+        Convert(inputFile, outputFile, quantizedFile);
+    } else if(!Quantize(inputFile, quantizedFile)) {
+        return 1;
+    }
 }
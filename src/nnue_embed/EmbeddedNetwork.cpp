@@ -0,0 +1,35 @@
+#include "NNUE.h"
+
+//The quantized network file (NNUE_EMBEDDED_FILE, set by CMake) is assembled into the read-only data,
+//aligned to a cache line as the header expects, so the engine uses it in place: no file I/O and no conversion.
+//The section is pushed and popped: the code after the asm stays in the section the compiler was using.
+//.incbin is supported by the GNU and Clang assemblers; MSVC builds link NoNetwork.cpp instead
+#ifdef __APPLE__
+    #define EMBEDDED_SECTION ".pushsection __DATA,__const\n"
+    #define EMBEDDED_SYMBOL(name) "_" #name
+#else
+    #define EMBEDDED_SECTION ".pushsection .rodata\n"
+    #define EMBEDDED_SYMBOL(name) #name
+#endif
+
+asm(
+    EMBEDDED_SECTION
+    ".balign 64\n"
+    ".global " EMBEDDED_SYMBOL(embeddedNetworkBegin) "\n"
+    EMBEDDED_SYMBOL(embeddedNetworkBegin) ":\n"
+    ".incbin \"" NNUE_EMBEDDED_FILE "\"\n"
+    ".global " EMBEDDED_SYMBOL(embeddedNetworkEnd) "\n"
+    EMBEDDED_SYMBOL(embeddedNetworkEnd) ":\n"
+    ".popsection\n"
+);
+
+extern "C" const u8 embeddedNetworkBegin[];
+extern "C" const u8 embeddedNetworkEnd[];
+
+const u8* NNUENetwork::EmbeddedData() {
+    return embeddedNetworkBegin;
+}
+
+u64 NNUENetwork::EmbeddedSize() {
+    return embeddedNetworkEnd - embeddedNetworkBegin;
+}
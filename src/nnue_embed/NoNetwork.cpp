@@ -0,0 +1,11 @@
+#include "NNUE.h"
+
+//No network linked into the binary: the default one is read from the working directory.
+//Used by the tools and the tests, and when CMake NNUE_EMBED is empty or not found
+const u8* NNUENetwork::EmbeddedData() {
+    return nullptr;
+}
+
+u64 NNUENetwork::EmbeddedSize() {
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include "Attacks.h"
 #include "Evaluation.h"
 #include "NNUE.h"
+#include "NNUEKernels.h"
 #include "ZobristKeys.h"
 
 #include <iostream>
@@ -24,7 +25,8 @@ namespace TestCommon {
         Attacks::Init();
         Evaluation::Init(); //after Attacks
         ZobristKeys::Init();
-        nnue.Load();
+        NNUEKernels::Init();
+        NNUENetwork::Load();
     }
 
     class CoutHelper {
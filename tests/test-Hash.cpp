@@ -0,0 +1,81 @@
+#include "test-Common.h"
+
+#include "Board.h"
+#include "Hash.h"
+
+#include <gtest/gtest.h>
+
+class HashTest : public ::testing::Test {
+protected:
+    TT tt;
+    Move move = Move(E2, E4, PAWN, DOUBLE_PUSH);
+    u64 zkey = 0x9102289248220842;
+};
+
+TEST_F(HashTest, AddAndProbe) {
+    tt.AddEntry(zkey, -123, 45, TTENTRY_TYPE::UPPER_BOUND, move, 7, 0, 3);
+
+    std::optional<TTEntry> entry = tt.ProbeEntry(zkey, 7);
+    ASSERT_TRUE(entry.has_value());
+    EXPECT_EQ(entry->score, -123);
+    EXPECT_EQ(entry->eval, 45);
+    EXPECT_EQ(entry->depth, 7);
+    EXPECT_EQ(entry->type, TTENTRY_TYPE::UPPER_BOUND);
+    EXPECT_EQ(entry->age, 3);
+    EXPECT_EQ(entry->bestMove, move.Compact());
+
+    EXPECT_FALSE( tt.ProbeEntry(zkey, 8).has_value() ); //not deep enough
+    EXPECT_FALSE( tt.ProbeEntry(zkey ^ 1, 0).has_value() ); //another position
+}
+
+TEST_F(HashTest, MateScores) {
+    int ply = 5;
+    tt.AddEntry(zkey, MATESCORE - 10, TT_NO_EVAL, TTENTRY_TYPE::EXACT, move, 3, ply, 0);
+
+    std::optional<TTEntry> entry = tt.ProbeEntry(zkey, 0);
+    ASSERT_TRUE(entry.has_value());
+    EXPECT_EQ(tt.ScoreFromHash(entry->score, ply), MATESCORE - 10);
+    EXPECT_EQ(tt.ScoreFromHash(entry->score, ply + 2), MATESCORE - 12);
+}
+
+TEST_F(HashTest, KeepMoveOnNullMoveCutoff) {
+    tt.AddEntry(zkey, 10, 0, TTENTRY_TYPE::EXACT, move, 4, 0, 0);
+    tt.AddEntry(zkey, 80, 0, TTENTRY_TYPE::LOWER_BOUND, Move(), 5, 0, 0);
+
+    std::optional<TTEntry> entry = tt.ProbeEntry(zkey, 0);
+    ASSERT_TRUE(entry.has_value());
+    EXPECT_EQ(entry->score, 80);
+    EXPECT_EQ(entry->bestMove, move.Compact());
+}
+
+TEST_F(HashTest, Clear) {
+    tt.AddEntry(zkey, 50, -50, TTENTRY_TYPE::LOWER_BOUND, move, 1, 0, 0);
+    EXPECT_EQ(tt.NumEntries(), (u64)1);
+    tt.Clear();
+    EXPECT_EQ(tt.NumEntries(), (u64)0);
+    EXPECT_FALSE( tt.ProbeEntry(zkey, 0).has_value() );
+}
+
+TEST_F(HashTest, SetSize) {
+    tt.SetSize(1);
+    EXPECT_EQ(tt.Size(), (u64)(1024 * 1024 / sizeof(TTBucket) * TT_BUCKET_ENTRIES));
+
+    tt.AddEntry(zkey, 50, -50, TTENTRY_TYPE::LOWER_BOUND, move, 1, 0, 0);
+    EXPECT_TRUE( tt.ProbeEntry(zkey, 0).has_value() );
+}
+
+TEST_F(HashTest, EvalCache) {
+    EvalCache cache;
+    EXPECT_FALSE( cache.ProbeEntry(zkey).has_value() );
+
+    cache.AddEntry(zkey, -37);
+    std::optional<int> eval = cache.ProbeEntry(zkey);
+    ASSERT_TRUE(eval.has_value());
+    EXPECT_EQ(*eval, -37);
+    EXPECT_FALSE( cache.ProbeEntry(zkey + EVAL_CACHE_SIZE).has_value() ); //same slot, another position
+    EXPECT_EQ(cache.Probes(), (u64)3);
+    EXPECT_EQ(cache.Hits(), (u64)1);
+
+    cache.Clear();
+    EXPECT_FALSE( cache.ProbeEntry(zkey).has_value() );
+}
@@ -1,5 +1,7 @@
 #include "Search.h"
+#include "Uci.h"
 #include <iostream>
+#include <thread>
 
 #include "test-Common.h"
 using namespace TestCommon;
@@ -25,6 +27,69 @@ TEST_F(PositionMisc, Fine70) {
     EXPECT_EQ(search.BestMove().Notation(), "a1b1");
 }
 
+TEST_F(PositionMisc, Fine70_Threads) {
+    board.SetFen("8/k7/3p4/p2P1p2/P2P1P2/8/8/K7 w - -");
+    search.SetThreads(4);
+    search.FixTime(3000);
+    search.IterativeDeepening(board);
+    EXPECT_EQ(search.BestMove().Notation(), "a1b1");
+}
+
+//Helpers that end before they start (or start after the main search ended) must not hang the search,
+//and their result can't be deeper than the depth limit
+TEST_F(PositionMisc, DepthOne_Threads) {
+    bool classicalEval = UCI_CLASSICAL_EVAL;
+    UCI_CLASSICAL_EVAL = true;
+    board.Init();
+
+    Search single;
+    single.FixDepth(1);
+    single.IterativeDeepening(board);
+
+    search.SetThreads(8);
+    for(int i = 0; i < 20; i++) {
+        search.FixDepth(1);
+        search.IterativeDeepening(board);
+        EXPECT_EQ(search.BestMove().Notation(), single.BestMove().Notation());
+    }
+    UCI_CLASSICAL_EVAL = classicalEval;
+}
+
+//The node limit is shared by all the threads, not given to each of them
+TEST_F(PositionMisc, FixNodes_Threads) {
+    const u64 limit = 200000;
+    board.SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+    search.SetThreads(4);
+    for(int i = 0; i < 3; i++) {
+        Limits limits;
+        limits.nodes = limit;
+        search.AllocateLimits(board, limits);
+        search.IterativeDeepening(board);
+        EXPECT_GE(search.GetNodes(), limit);
+        EXPECT_LT(search.GetNodes(), limit + limit / 2);
+        EXPECT_NE(search.BestMove().MoveType(), NULLMOVE);
+    }
+}
+
+//The eval cache belongs to the Search: a search on another thread (as each "go") reuses the evals
+//of the previous one
+TEST_F(PositionMisc, EvalCacheKeptBetweenSearches) {
+    board.SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+    search.FixDepth(4);
+    search.IterativeDeepening(board);
+    EXPECT_GT(search.GetEvalCache().Probes(), (u64)0);
+    EXPECT_EQ(Hash::evalCache, nullptr); //only bound during the search
+
+    Hash::tt.Clear();
+    search.GetEvalCache().ClearStats();
+    std::thread thread([&]() { search.IterativeDeepening(board); });
+    thread.join();
+    EXPECT_GT(search.GetEvalCache().Hits(), (u64)0);
+
+    search.ClearEvalTables();
+    EXPECT_FALSE(search.GetEvalCache().ProbeEntry(board.ZKey()).has_value());
+}
+
 //Mate tests
 
 // Difficult mate in #5. Too much pruning will see mate in #6
@@ -0,0 +1,99 @@
+#include "test-Common.h"
+
+#include "Board.h"
+#include "Heuristics.h"
+#include "MoveGenerator.h"
+#include "MovePicker.h"
+
+#include <algorithm>
+#include <gtest/gtest.h>
+
+class MovePickerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        heuristics.killer.Clear();
+        heuristics.history.Clear();
+    }
+
+    MoveList PickAll(u16 hashMove, int ply = 0) {
+        MovePicker picker(board, hashMove, heuristics, ply);
+        MoveList picked;
+        Move move;
+        while( (move = picker.NextMove()).MoveType() != NULLMOVE ) {
+            picked.push_back(move);
+        }
+        return picked;
+    }
+
+    //Every legal move is picked exactly once
+    void ExpectSameMoves(MoveList picked) {
+        MoveGenerator gen;
+        MoveList legal = gen.GenerateMoves(board);
+        ASSERT_EQ(picked.size(), legal.size());
+        for(Move move : legal) {
+            EXPECT_EQ(std::count(picked.begin(), picked.end(), move), 1) << move.Notation();
+        }
+    }
+
+    Board board;
+    Heuristics heuristics;
+};
+
+TEST_F(MovePickerTest, AllMovesWithEveryHashMove) {
+    for(std::string fen : { "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+                            "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -",
+                            "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1" }) {
+        board.SetFen(fen);
+        ExpectSameMoves(PickAll(0));
+
+        MoveGenerator gen;
+        for(Move hashMove : gen.GenerateMoves(board)) {
+            MoveList picked = PickAll(hashMove.Compact());
+            ASSERT_FALSE(picked.empty());
+            EXPECT_EQ(picked.front(), hashMove);
+            ExpectSameMoves(picked);
+        }
+    }
+}
+
+TEST_F(MovePickerTest, Stages) {
+    board.SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+    Move killer = Move(A2, A3, PAWN, NORMAL);
+    Move badKiller = Move(B1, C3, KNIGHT, NORMAL); //no knight on b1
+    heuristics.killer.Update(badKiller, 2);
+    heuristics.killer.Update(killer, 2);
+
+    MoveList picked = PickAll(Move(E2, A6, BISHOP, CAPTURE).Compact(), 2);
+    ExpectSameMoves(picked);
+
+    //Hash move, good captures, killer, quiets (history 1-180 and underpromotions 0), bad captures
+    EXPECT_EQ(picked[0].Score(), 255);
+    auto killerIt = std::find(picked.begin(), picked.end(), killer);
+    ASSERT_NE(killerIt, picked.end());
+    EXPECT_EQ(killerIt->Score(), 194);
+    for(auto it = picked.begin() + 1; it != killerIt; ++it) {
+        EXPECT_TRUE(it->IsCapture() && it->Score() >= 240) << it->Notation();
+    }
+    bool badCaptures = false;
+    for(auto it = killerIt + 1; it != picked.end(); ++it) {
+        badCaptures |= it->IsCapture();
+        EXPECT_EQ(it->IsCapture(), badCaptures) << it->Notation();
+    }
+}
+
+TEST_F(MovePickerTest, Evasions) {
+    board.SetFen("rnbqkbnr/ppp2ppp/8/1B1pp3/4P3/8/PPPP1PPP/RNBQK1NR b KQkq - 1 3");
+    MovePicker picker(board, 0, heuristics, 0);
+    EXPECT_EQ(picker.NumEvasions(), 6); //c6, Nc6, Nd7, Bd7, Qd7, Ke7
+    ExpectSameMoves(PickAll(0));
+
+    board.SetFen("rnb1kbnr/pppp1ppp/8/4p3/6Pq/5P2/PPPPP2P/RNBQKBNR w KQkq - 1 3"); //fool's mate
+    MovePicker mated(board, 0, heuristics, 0);
+    EXPECT_EQ(mated.NumEvasions(), 0);
+    EXPECT_EQ(mated.NextMove().MoveType(), NULLMOVE);
+}
+
+TEST_F(MovePickerTest, Stalemate) {
+    board.SetFen("7k/5Q2/6K1/8/8/8/8/8 b - - 0 1");
+    EXPECT_TRUE(PickAll(0).empty());
+}
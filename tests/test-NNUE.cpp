@@ -0,0 +1,479 @@
+#include "test-Common.h"
+
+#include "Board.h"
+#include "MoveGenerator.h"
+#include "NNUE.h"
+#include "NNUEKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+
+//Copy of the table in NNUE.cpp
+const int KING_BUCKETS[64] = {
+     0, 1, 2, 3, 4, 5, 6, 7,
+     8, 9,10,11,12,13,14,15,
+    16,16,17,17,18,18,19,19,
+    20,20,21,21,22,22,23,23,
+    24,24,25,25,26,26,27,27,
+    24,24,25,25,26,26,27,27,
+    28,28,29,29,30,30,31,31,
+    28,28,29,29,30,30,31,31
+};
+
+class NNUETest : public ::testing::Test {
+protected:
+    //Random layer 1 in the network in use (m_network, set again by the tests that change it).
+    //The loaded network is restored at the end
+    void SetUp() override {
+        backup = std::make_unique<Network>(*NNUENetwork::weights);
+        m_network = std::make_unique<Network>(*backup);
+
+        std::mt19937 rng(2024);
+        std::uniform_int_distribution<int> weight(-300, 300);
+        for(auto &w : m_network->w1) {
+            w = (i16)weight(rng);
+        }
+        for(auto &b : m_network->b1) {
+            b = (i16)weight(rng);
+        }
+        NNUENetwork::SetNetwork(*m_network);
+    }
+    void TearDown() override {
+        NNUENetwork::SetNetwork(*backup);
+    }
+
+    //Sum of the weights of the active features, in int32
+    void ExpectAccumulator(Board &board) {
+        const int kingSquare[2] = { BitscanForward(board.GetPieces(WHITE, KING)),
+                                    BitscanForward(board.GetPieces(BLACK, KING)) ^ 56 };
+        for(int perspective = WHITE; perspective <= BLACK; perspective++) {
+            int expected[NNUE_SIZE];
+            for(int i = 0; i < NNUE_SIZE; i++) {
+                expected[i] = m_network->b1[i];
+            }
+            for(int color = WHITE; color <= BLACK; color++) {
+                for(int pieceType = PAWN; pieceType <= QUEEN; pieceType++) {
+                    Bitboard bitboard = board.GetPieces((COLOR)color, (PIECE_TYPE)pieceType);
+                    while(bitboard) {
+                        int square = ResetLsb(bitboard);
+                        int index = 2 * (pieceType - 1) + (perspective == WHITE ? color : 1 - color);
+                        int feature = 640 * KING_BUCKETS[kingSquare[perspective]] + 64 * index
+                                    + (perspective == WHITE ? square : square ^ 56);
+                        for(int i = 0; i < NNUE_SIZE; i++) {
+                            expected[i] += m_network->w1[NNUE_SIZE * feature + i];
+                        }
+                    }
+                }
+            }
+
+            NNUE& nnue = board.GetNNUE();
+            nnue.ComputeAccumulator(board);
+            const i16* accumulator = nnue.Accumulator(perspective);
+            for(int i = 0; i < NNUE_SIZE; i++) {
+                ASSERT_EQ(accumulator[i], expected[i]) << board.GetSimplifiedFen() << " perspective " << perspective << " [" << i << "]";
+            }
+        }
+    }
+
+    std::unique_ptr<Network> backup;
+    std::unique_ptr<Network> m_network;
+};
+
+//Incremental updates after MakeMove/TakeMove are bit-exact with a full computation,
+//also when they are deferred over several moves (and null moves)
+TEST_F(NNUETest, IncrementalMatchesFullUpdate) {
+    std::mt19937 rng(7);
+    for(std::string fen : { "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+                            "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1",
+                            "rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3",
+                            "n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b - - 0 1", //promotions
+                            "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -" }) { //king moves: refresh table
+        Board board;
+        board.SetFen(fen);
+        ExpectAccumulator(board);
+
+        for(int game = 0; game < 4; game++) {
+            std::vector<Move> played;
+            for(int ply = 0; ply < 40; ply++) {
+                MoveGenerator gen;
+                MoveList& moves = gen.GenerateMoves(board);
+                if(moves.empty())
+                    break;
+                if(!board.IsCheck() && rng() % 8 == 0) {
+                    board.MakeNull();
+                    played.push_back(Move());
+                } else {
+                    Move move = moves[rng() % moves.size()];
+                    board.MakeMove(move);
+                    played.push_back(move);
+                }
+                if(rng() % 3 == 0)
+                    ExpectAccumulator(board);
+            }
+            while(!played.empty()) {
+                if(played.back().MoveType() == NULLMOVE)
+                    board.TakeNull();
+                else
+                    board.TakeMove(played.back());
+                played.pop_back();
+                if(rng() % 2 == 0)
+                    ExpectAccumulator(board);
+            }
+            ExpectAccumulator(board);
+        }
+    }
+}
+
+//Lines longer than the accumulator stack, from the root and back
+TEST_F(NNUETest, DeeperThanTheStack) {
+    std::mt19937 rng(5);
+    Board board;
+    board.SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+
+    std::vector<Move> played;
+    auto TakeBack = [&]() {
+        if(played.back().MoveType() == NULLMOVE)
+            board.TakeNull();
+        else
+            board.TakeMove(played.back());
+        played.pop_back();
+    };
+
+    while(played.size() < ACCUMULATOR_STACK_SIZE + 40) {
+        MoveGenerator gen;
+        MoveList& moves = gen.GenerateMoves(board);
+        if(moves.empty()) { //game over: another try
+            TakeBack();
+            continue;
+        }
+        if(!board.IsCheck() && rng() % 2 == 0) {
+            board.MakeNull();
+            played.push_back(Move());
+        } else {
+            Move move = moves[rng() % moves.size()];
+            board.MakeMove(move);
+            played.push_back(move);
+        }
+        if(played.size() > ACCUMULATOR_STACK_SIZE - 10)
+            ExpectAccumulator(board);
+    }
+
+    while(!played.empty()) {
+        TakeBack();
+        if(rng() % 4 == 0)
+            ExpectAccumulator(board);
+    }
+    ExpectAccumulator(board);
+}
+
+//Each board owns its accumulators: boards searched in parallel (or a copy of a board) don't interfere.
+//A copy doesn't take the accumulator stack: it is refreshed, also when a move before the copy is taken back
+TEST_F(NNUETest, BoardsAreIndependent) {
+    std::mt19937 rng(11);
+    Board boards[2];
+    boards[0].SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+    boards[1].SetFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+
+    std::vector<Move> played;
+    for(int ply = 0; ply < 30; ply++) {
+        for(Board &board : boards) {
+            MoveGenerator gen;
+            MoveList& moves = gen.GenerateMoves(board);
+            if(moves.empty())
+                continue;
+            Move move = moves[rng() % moves.size()];
+            board.MakeMove(move);
+            if(&board == &boards[0])
+                played.push_back(move);
+            ExpectAccumulator(board);
+        }
+    }
+
+    Board copy = boards[0];
+    MoveGenerator gen;
+    for(Move move : gen.GenerateMoves(copy)) {
+        copy.MakeMove(move);
+        ExpectAccumulator(copy);
+        copy.TakeMove(move);
+    }
+    ExpectAccumulator(copy);
+    for(int i = 0; i < 2 && !played.empty(); i++) {
+        copy.TakeMove(played.back());
+        played.pop_back();
+        ExpectAccumulator(copy);
+    }
+
+    copy = boards[1];
+    ExpectAccumulator(copy);
+    ExpectAccumulator(boards[0]);
+    ExpectAccumulator(boards[1]);
+}
+
+//The kernels of every instruction set supported by this CPU give the results of the scalar ones
+TEST_F(NNUETest, KernelsAgree) {
+    std::mt19937 rng(3);
+    auto Random = [&rng](int min, int max) { return std::uniform_int_distribution<int>(min, max)(rng); };
+
+    alignas(64) i16 accumulator[NNUE_SIZE];
+    alignas(64) u8 input[2 * NNUE_SIZE];
+    alignas(64) i8 weights[ ARCH_DIMENSIONS[L2][W] ];
+    int biases[ ARCH[L2][COL] ];
+    for(auto &a : accumulator) a = (i16)Random(-3000, 3000);
+    for(auto &i : input) i = Random(0, 1) ? (u8)Random(1, ACTIVATION_ONE) : 0; //sparse, as after the clipped ReLU
+    for(int block = 0; block < 2 * NNUE_SIZE / 4; block += 3) {
+        std::fill(&input[4 * block], &input[4 * block + 4], 0);
+    }
+    for(auto &w : weights) w = (i8)Random(-127, 127);
+    for(auto &b : biases) b = Random(-100000, 100000);
+    const int added[2] = { Random(0, NNUE_FEATURES-1), Random(0, NNUE_FEATURES-1) };
+    const int removed[1] = { Random(0, NNUE_FEATURES-1) };
+
+    struct Results {
+        alignas(64) i16 updated[NNUE_SIZE];
+        alignas(64) u8 activated[NNUE_SIZE];
+        int layer[ ARCH[L2][COL] ];
+        int smallLayer[ ARCH[L3][COL] ];
+        int output[ ARCH[L4][COL] ];
+    };
+    auto Run = [&](Results &results) {
+        const NNUEKernels::Kernels& kernels = NNUEKernels::kernels;
+        kernels.UpdateAccumulator(accumulator, results.updated, added, 2, removed, 1);
+        kernels.ActivateAccumulator(accumulator, results.activated);
+        kernels.ComputeLayer[L2](input, results.layer, biases, weights);
+        kernels.ComputeLayer[L3](input, results.smallLayer, biases, weights);
+        kernels.ComputeLayer[L4](input, results.output, biases, weights);
+    };
+
+    Results expected, results;
+    NNUEKernels::Init(SIMD_SCALAR);
+    Run(expected);
+    for(int level = SIMD_SSE41; level <= NNUEKernels::DetectLevel(); level++) {
+        NNUEKernels::Init((SIMD_LEVEL)level);
+        Run(results);
+        std::string name = NNUEKernels::LevelName((SIMD_LEVEL)level);
+        for(int i = 0; i < NNUE_SIZE; i++) {
+            EXPECT_EQ(results.updated[i], expected.updated[i]) << name << " [" << i << "]";
+            EXPECT_EQ(results.activated[i], expected.activated[i]) << name << " [" << i << "]";
+        }
+        for(uint o = 0; o < ARCH[L2][COL]; o++) {
+            EXPECT_EQ(results.layer[o], expected.layer[o]) << name << " [" << o << "]";
+        }
+        for(uint o = 0; o < ARCH[L3][COL]; o++) {
+            EXPECT_EQ(results.smallLayer[o], expected.smallLayer[o]) << name << " [" << o << "]";
+        }
+        EXPECT_EQ(results.output[0], expected.output[0]) << name;
+    }
+    NNUEKernels::Init();
+}
+
+//Float inference of the file format, as the engine did before the quantization
+float FloatEvaluate(const NetworkStorage &storage, Board &board, int color) {
+    const int kingSquare[2] = { BitscanForward(board.GetPieces(WHITE, KING)),
+                                BitscanForward(board.GetPieces(BLACK, KING)) ^ 56 };
+    float o1[2 * NNUE_SIZE];
+    for(int perspective = WHITE; perspective <= BLACK; perspective++) {
+        float* accumulator = &o1[perspective == color ? 0 : NNUE_SIZE];
+        for(int i = 0; i < NNUE_SIZE; i++) {
+            accumulator[i] = storage.b1[i];
+        }
+        for(int pieceColor = WHITE; pieceColor <= BLACK; pieceColor++) {
+            for(int pieceType = PAWN; pieceType <= QUEEN; pieceType++) {
+                Bitboard bitboard = board.GetPieces((COLOR)pieceColor, (PIECE_TYPE)pieceType);
+                while(bitboard) {
+                    int square = ResetLsb(bitboard);
+                    int index = 2 * (pieceType - 1) + (perspective == WHITE ? pieceColor : 1 - pieceColor);
+                    int feature = 640 * KING_BUCKETS[kingSquare[perspective]] + 64 * index
+                                + (perspective == WHITE ? square : square ^ 56);
+                    for(int i = 0; i < NNUE_SIZE; i++) {
+                        accumulator[i] += (float)storage.w1[NNUE_SIZE * feature + i] / CONVERSION_FACTOR;
+                    }
+                }
+            }
+        }
+    }
+
+    auto Layer = [](const float* input, float* output, const float* biases, const float* weights, int dimInput, int dimOutput) {
+        for(int o = 0; o < dimOutput; o++) {
+            output[o] = biases[o];
+            for(int i = 0; i < dimInput; i++) {
+                output[o] += input[i] * weights[o * dimInput + i];
+            }
+        }
+    };
+    auto Clamp = [](float* values, int dim) {
+        for(int i = 0; i < dim; i++) {
+            values[i] = std::clamp(values[i], 0.0f, 1.0f);
+        }
+    };
+
+    float o2[ ARCH[L2][COL] ], o3[ ARCH[L3][COL] ], o4[1];
+    Clamp(o1, 2 * NNUE_SIZE);
+    Layer(o1, o2, storage.b2, storage.w2, ARCH[L2][ROW], ARCH[L2][COL]);
+    Clamp(o2, ARCH[L2][COL]);
+    Layer(o2, o3, storage.b3, storage.w3, ARCH[L3][ROW], ARCH[L3][COL]);
+    Clamp(o3, ARCH[L3][COL]);
+    Layer(o3, o4, storage.b4, storage.w4, ARCH[L4][ROW], ARCH[L4][COL]);
+    return o4[0] * 100;
+}
+
+//The quantized hidden layers stay close to the float network
+//Float network in the ranges of a trained one
+void RandomStorage(NetworkStorage &storage, std::mt19937 &rng) {
+    auto Uniform = [&rng](float min, float max) { return std::uniform_real_distribution<float>(min, max)(rng); };
+    for(auto &w : storage.w1) w = (i16)(Uniform(-0.05f, 0.05f) * CONVERSION_FACTOR);
+    for(auto &b : storage.b1) b = Uniform(0.0f, 0.5f);
+    for(auto &w : storage.w2) w = Uniform(-0.1f, 0.1f);
+    for(auto &b : storage.b2) b = Uniform(0.0f, 0.5f);
+    for(auto &w : storage.w3) w = Uniform(-0.5f, 0.5f);
+    for(auto &b : storage.b3) b = Uniform(0.0f, 0.5f);
+    for(auto &w : storage.w4) w = Uniform(-1.0f, 1.0f);
+    for(auto &b : storage.b4) b = Uniform(-0.5f, 0.5f);
+}
+
+TEST_F(NNUETest, QuantizedMatchesFloat) {
+    auto storage = std::make_unique<NetworkStorage>();
+    std::mt19937 rng(11);
+    RandomStorage(*storage, rng);
+    EXPECT_EQ(QuantizeNetwork(*storage, *m_network), 0);
+    NNUENetwork::SetNetwork(*m_network);
+
+    //Positions of random games
+    Board board;
+    board.SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+    for(int ply = 0; ply < 200; ply++) {
+        float expected = FloatEvaluate(*storage, board, board.ActivePlayer());
+        //int8 weights have steps of 1/64: a few percent of error
+        EXPECT_NEAR(board.GetNNUE().Evaluate(board), expected, 10 + std::abs(expected) * 0.1f) << board.GetSimplifiedFen();
+
+        MoveGenerator gen;
+        MoveList& moves = gen.GenerateMoves(board);
+        if(moves.empty() || ply % 50 == 49) {
+            board.SetFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+            continue;
+        }
+        board.MakeMove(moves[rng() % moves.size()]);
+    }
+}
+
+//The batch evaluation of boards and fens gives the scores of NNUE::Evaluate, with any number of threads
+//and the batch kernels of every level
+TEST_F(NNUETest, BatchMatchesEvaluate) {
+    auto storage = std::make_unique<NetworkStorage>();
+    std::mt19937 rng(13);
+    RandomStorage(*storage, rng);
+    QuantizeNetwork(*storage, *m_network);
+    NNUENetwork::SetNetwork(*m_network);
+
+    std::vector<BatchPosition> positions;
+    std::vector<std::string> fens;
+    std::vector<int> expected;
+    Board board;
+    board.SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+    for(int ply = 0; ply < 150; ply++) {
+        positions.push_back(NNUEBatch::FromBoard(board));
+        fens.push_back(board.GetSimplifiedFen() + (board.ActivePlayer() == WHITE ? " w" : " b"));
+        expected.push_back(board.GetNNUE().Evaluate(board));
+
+        MoveGenerator gen;
+        MoveList& moves = gen.GenerateMoves(board);
+        if(moves.empty() || ply % 50 == 49) {
+            board.SetFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+            continue;
+        }
+        board.MakeMove(moves[rng() % moves.size()]);
+    }
+
+    for(int threads : {1, 3}) {
+        EXPECT_EQ(NNUEBatch::Evaluate(positions, threads), expected) << threads << " threads";
+        EXPECT_EQ(NNUEBatch::Evaluate(fens, threads), expected) << threads << " threads";
+    }
+    for(int level = SIMD_SCALAR; level <= NNUEKernels::DetectLevel(); level++) {
+        NNUEKernels::Init((SIMD_LEVEL)level);
+        EXPECT_EQ(NNUEBatch::Evaluate(positions, 1), expected) << NNUEKernels::LevelName((SIMD_LEVEL)level);
+    }
+    NNUEKernels::Init();
+
+    BatchPosition position;
+    EXPECT_FALSE(NNUEBatch::FromFen("rnbq1bnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", position)); //no black king
+    EXPECT_FALSE(NNUEBatch::FromFen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR", position)); //no active player
+    fens.push_back("8/8/8/8/8/8/8/8 w - -");
+    EXPECT_EQ(NNUEBatch::Evaluate(fens).back(), 0);
+}
+
+//A network saved in the quantized format is mapped as it is, and evaluates as the original.
+//Files of another version are rejected, and the network in use is kept
+TEST_F(NNUETest, MappedNetwork) {
+    std::mt19937 rng(3);
+    std::uniform_int_distribution<int> weight(-64, 64);
+    for(auto &w : m_network->w2) w = (i8)weight(rng);
+    for(auto &w : m_network->w3) w = (i8)weight(rng);
+    for(auto &w : m_network->w4) w = (i8)weight(rng);
+    for(auto &b : m_network->b2) b = weight(rng) * ACTIVATION_ONE;
+    NNUENetwork::SetNetwork(*m_network);
+
+    //Evaluations with the network in memory
+    Board board;
+    board.SetFen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -");
+    MoveGenerator gen;
+    MoveList moves = gen.GenerateMoves(board);
+    std::vector<int> expected;
+    for(Move move : moves) {
+        board.MakeMove(move);
+        board.ResetNNUE();
+        expected.push_back(board.GetNNUE().Evaluate(board));
+        board.TakeMove(move);
+    }
+
+    const std::string path = (std::filesystem::temp_directory_path() / "casanchess-test.qnn").string();
+    const std::string oldPath = (std::filesystem::temp_directory_path() / "casanchess-test-old.qnn").string();
+    ASSERT_TRUE(NNUENetwork::Save(path, *m_network));
+
+    //Same file with another version
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        NetworkHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        header.version++;
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        std::ofstream out(oldPath, std::ios::binary);
+        out.write(bytes.data(), bytes.size());
+    }
+
+    const std::string previousPath = NNUENetwork::GetPath();
+    TestCommon::CoutHelper cout;
+    cout.Mute();
+    NNUENetwork::Load(path);
+    cout.Speak();
+    ASSERT_TRUE(NNUENetwork::IsMapped());
+    EXPECT_EQ(std::memcmp(NNUENetwork::weights, m_network.get(), sizeof(Network)), 0);
+
+    const Network* mapped = NNUENetwork::weights;
+    cout.Mute();
+    NNUENetwork::Load(oldPath);
+    NNUENetwork::Load(oldPath + ".missing");
+    cout.Speak();
+    EXPECT_EQ(NNUENetwork::weights, mapped);
+    EXPECT_EQ(NNUENetwork::GetPath(), path); //the rejected files are not reported
+
+    for(size_t i = 0; i < moves.size(); i++) {
+        board.MakeMove(moves[i]);
+        board.ResetNNUE();
+        EXPECT_EQ(board.GetNNUE().Evaluate(board), expected[i]) << board.GetSimplifiedFen();
+        board.TakeMove(moves[i]);
+    }
+
+    //The network file of the engine is loaded again, if there is one (the network is restored by TearDown)
+    cout.Mute();
+    NNUENetwork::Load(previousPath);
+    cout.Speak();
+    std::filesystem::remove(path);
+    std::filesystem::remove(oldPath);
+}
@@ -18,7 +18,7 @@ TEST(MoveGenerator, StartingPosition) {
     Board board;
 
     MoveGenerator generator;
-    MoveList moves = generator.GenerateMoves(board);
+    MoveList& moves = generator.GenerateMoves(board);
 
     EXPECT_EQ(moves.size(), (size_t)20);
 }
@@ -1,3 +1,4 @@
+#include "Attacks.h"
 #include "BitboardUtils.h"
 #include "Utils.h"
 
@@ -80,3 +81,34 @@ TEST(BitboardUtils, RemoveLsb) {
     RemoveLsb(b);
     EXPECT_EQ(b, (u64)3377802801840128);
 }
+
+//Attacks
+TEST(Attacks, SlidingMatchesClassical) {
+    Utils::PRNG_64 rng(1234);
+    for(int i = 0; i < 1000; i++) {
+        Bitboard blockers = rng.Random() & rng.Random();
+        for(int square = 0; square < 64; square++) {
+            for(PIECE_TYPE pieceType : {BISHOP, ROOK, QUEEN}) {
+                ASSERT_EQ(Attacks::AttacksSliding(pieceType, square, blockers),
+                          Attacks::AttacksSlidingClassical(pieceType, square, blockers));
+            }
+        }
+    }
+}
+
+TEST(Attacks, SlidingAllBlockerSubsets) {
+    //Every subset of the relevant blockers of every square: catches a bad magic
+    for(int square = 0; square < 64; square++) {
+        for(PIECE_TYPE pieceType : {BISHOP, ROOK}) {
+            Bitboard edges = ((MaskRank[RANK1] | MaskRank[RANK8]) & ~MaskRank[Rank(square)])
+                           | ((MaskFile[FILEA] | MaskFile[FILEH]) & ~MaskFile[File(square)]);
+            Bitboard mask = Attacks::AttacksSlidingClassical(pieceType, square, ZERO) & ~edges;
+            Bitboard blockers = ZERO;
+            do {
+                ASSERT_EQ(Attacks::AttacksSliding(pieceType, square, blockers),
+                          Attacks::AttacksSlidingClassical(pieceType, square, blockers));
+                blockers = (blockers - mask) & mask;
+            } while(blockers);
+        }
+    }
+}